@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+// Parameters of &tb_cmd. A command is a frame of `length` bits (sent most
+// significant bit first), kept in bits 16 and up, with the bits below.
+#define TB_FRAME(length, value) (((length) << 16) | (value))
+#define TB_FRAME_LENGTH(command) ((command) >> 16)
+#define TB_FRAME_VALUE(command) ((command) & 0xFFFF)
+
+#define TB_CMD_SET_MOVE TB_FRAME(0, 0)
+#define TB_CMD_TG_SCROLL TB_FRAME(1, 0)
+#define TB_CMD_CYC_DPI TB_FRAME(1, 1)
+#define TB_CMD_SET_SCROLL TB_FRAME(2, 0)
+#define TB_CMD_SET_SNIPE TB_FRAME(3, 0)
+#define TB_CMD_SET_DPI(option) TB_FRAME(3, 4 | (option))
+
+// Extended commands are a 1 followed by a 3-bit opcode and a 4-bit operand.
+#define TB_OP_SET_CPI 0
+#define TB_OP_SET_SCROLL_DIVISOR_V 1
+#define TB_OP_SET_SCROLL_DIVISOR_H 2
+#define TB_OP_SET_ACCEL 3
+#define TB_OP_SET_MOMENTUM 4
+
+#define TB_CMD_EXT(opcode, operand) TB_FRAME(8, 0x80 | ((opcode) << 4) | (operand))
+
+// Commands for one of several trackballs are the address followed by 8 bits:
+// extended commands as they are, the others as a 1 and then the command,
+// padded with 0s in front. E.g. TB_ADDRESSED(1, 1, TB_CMD_SET_MOVE) for
+// LED_CMD_ADDRESS_LENGTH=1 and LED_CMD_ADDRESS=1.
+#define TB_INTERNAL_PAYLOAD(command)                                                               \
+    (TB_FRAME_LENGTH(command) == 8 ? TB_FRAME_VALUE(command)                                       \
+                                   : (1 << TB_FRAME_LENGTH(command)) | TB_FRAME_VALUE(command))
+#define TB_ADDRESSED(bits, address, command)                                                       \
+    TB_FRAME((bits) + 8, ((address) << 8) | TB_INTERNAL_PAYLOAD(command))
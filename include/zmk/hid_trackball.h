@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <zephyr/device.h>
+
+// Indicator echo time of the host measured by the link probe, 0 if unknown.
+uint16_t zmk_hid_trackball_echo_ms(void);
+
+// Lock LEDs (as in the HID LED report) the host echoed during the link probe,
+// 0 if unknown.
+uint8_t zmk_hid_trackball_usable_leds(void);
+
+// Queues a command (see dt-bindings/zmk/hid-trackball.h) on a
+// zmk,behavior-trackball-command instance.
+int zmk_hid_trackball_command_send(const struct device *dev, uint32_t command);
+
+// True while no zmk,behavior-trackball-command instance has keys left to tap,
+// or is still waiting out the delay after its last one.
+bool zmk_hid_trackball_command_idle(void);
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define DT_DRV_COMPAT zmk_behavior_trackball_command
+
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <drivers/behavior.h>
+#include <zmk/behavior.h>
+#include <zmk/hid_trackball.h>
+#include <zmk/events/keycode_state_changed.h>
+#include <dt-bindings/zmk/keys.h>
+#include <dt-bindings/zmk/hid-trackball.h>
+
+LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
+
+#if DT_HAS_COMPAT_STATUS_OKAY(DT_DRV_COMPAT)
+
+#define LED_CLCK 0x02
+
+// A frame of up to 16 bits, two lock key taps per bit and a marker tap on
+// either side, each tap being a press and a release.
+#define FRAME_MAX_LENGTH 16
+#define EMITTER_MAX_STEPS (2 * (2 + 2 * FRAME_MAX_LENGTH))
+#define EMITTER_QUEUE_SIZE 8
+
+struct behavior_tb_cmd_config {
+    int tap_ms;
+    int wait_ms;
+    int caps_tap_ms;
+    int caps_wait_ms;
+};
+
+struct emitter_step {
+    uint32_t keycode;
+    bool pressed;
+    // Time until the next step.
+    uint16_t delay_ms;
+};
+
+struct emitter_command {
+    const struct device *dev;
+    uint32_t command;
+};
+
+// All instances tap the same lock keys, so their commands go through one
+// emitter, one after the other. The timer paces the steps and the work item
+// raises their key events, which can't be done from the timer's interrupt.
+// A command stays active until the delay after its last step ran out too, so
+// the next one keeps that gap.
+static struct {
+    struct emitter_step steps[EMITTER_MAX_STEPS];
+    int len;
+    int emitted;
+    bool active;
+    atomic_t due;
+    struct k_timer timer;
+    struct k_work work;
+} emitter;
+
+K_MSGQ_DEFINE(emitter_queue, sizeof(struct emitter_command), EMITTER_QUEUE_SIZE, 4);
+
+static void add_tap(uint32_t keycode, int tap_ms, int wait_ms) {
+    emitter.steps[emitter.len++] = (struct emitter_step){keycode, true, tap_ms};
+    emitter.steps[emitter.len++] = (struct emitter_step){keycode, false, wait_ms};
+}
+
+// Num Lock and the frame markers take the configured timings, or the echo time
+// of the host if the link probe found it slower. Caps Lock needs slow taps on
+// hosts that delay it, unless the probe saw a short tap being echoed.
+static void build_frame(const struct behavior_tb_cmd_config *config, uint32_t command) {
+    int echo_ms = 0;
+    bool fast_caps = false;
+#if IS_ENABLED(CONFIG_ZMK_HID_TRACKBALL_INTERFACE_LINK_PROBE)
+    echo_ms = zmk_hid_trackball_echo_ms();
+    fast_caps = zmk_hid_trackball_usable_leds() & LED_CLCK;
+#endif
+    int tap_ms = config->tap_ms;
+    int wait_ms = MAX(config->wait_ms, echo_ms);
+    int caps_tap_ms = fast_caps ? tap_ms : config->caps_tap_ms;
+    int caps_wait_ms = fast_caps ? wait_ms : MAX(config->caps_wait_ms, echo_ms);
+    int length = TB_FRAME_LENGTH(command);
+
+    emitter.len = 0;
+    add_tap(SLCK, tap_ms, wait_ms);
+    for (int bit = length - 1; bit >= 0; bit--) {
+        if (TB_FRAME_VALUE(command) & BIT(bit)) {
+            add_tap(CLCK, caps_tap_ms, caps_wait_ms);
+            add_tap(CLCK, caps_tap_ms, caps_wait_ms);
+        } else {
+            add_tap(KP_NLCK, tap_ms, wait_ms);
+            add_tap(KP_NLCK, tap_ms, wait_ms);
+        }
+    }
+    add_tap(SLCK, tap_ms, wait_ms);
+}
+
+static void emitter_timer_expiry(struct k_timer *timer) {
+    int due = atomic_inc(&emitter.due) + 1;
+    if (due <= emitter.len) {
+        k_timer_start(&emitter.timer, K_MSEC(emitter.steps[due - 1].delay_ms), K_NO_WAIT);
+    }
+    k_work_submit(&emitter.work);
+}
+
+static void emitter_work_handler(struct k_work *item) {
+    for (;;) {
+        int due = atomic_get(&emitter.due);
+        while (emitter.emitted < MIN(due, emitter.len)) {
+            const struct emitter_step *step = &emitter.steps[emitter.emitted++];
+            raise_zmk_keycode_state_changed_from_encoded(step->keycode, step->pressed,
+                                                         k_uptime_get());
+        }
+        if (emitter.active && due <= emitter.len) {
+            return;
+        }
+        emitter.active = false;
+
+        struct emitter_command next;
+        if (k_msgq_get(&emitter_queue, &next, K_NO_WAIT) != 0) {
+            return;
+        }
+        build_frame(next.dev->config, next.command);
+        emitter.emitted = 0;
+        emitter.active = true;
+        atomic_set(&emitter.due, 1);
+        k_timer_start(&emitter.timer, K_MSEC(emitter.steps[0].delay_ms), K_NO_WAIT);
+    }
+}
+
+bool zmk_hid_trackball_command_idle(void) {
+    return !emitter.active && k_msgq_num_used_get(&emitter_queue) == 0;
+}
+
+int zmk_hid_trackball_command_send(const struct device *dev, uint32_t command) {
+    if (TB_FRAME_LENGTH(command) > FRAME_MAX_LENGTH) {
+        LOG_ERR("%s: trackball command 0x%x is too long", dev->name, command);
+        return -EINVAL;
+    }
+    struct emitter_command queued = {.dev = dev, .command = command};
+    if (k_msgq_put(&emitter_queue, &queued, K_NO_WAIT) != 0) {
+        LOG_WRN("%s: trackball command queue full, dropping 0x%x", dev->name, command);
+        return -ENOMEM;
+    }
+    k_work_submit(&emitter.work);
+    return 0;
+}
+
+static int on_keymap_binding_pressed(struct zmk_behavior_binding *binding,
+                                     struct zmk_behavior_binding_event event) {
+    zmk_hid_trackball_command_send(zmk_behavior_get_binding(binding->behavior_dev),
+                                   binding->param1);
+    return ZMK_BEHAVIOR_OPAQUE;
+}
+
+static int on_keymap_binding_released(struct zmk_behavior_binding *binding,
+                                      struct zmk_behavior_binding_event event) {
+    return ZMK_BEHAVIOR_OPAQUE;
+}
+
+static const struct behavior_driver_api behavior_tb_cmd_driver_api = {
+    .binding_pressed = on_keymap_binding_pressed,
+    .binding_released = on_keymap_binding_released,
+};
+
+static int behavior_tb_cmd_init(const struct device *dev) {
+    static bool emitter_initialized;
+
+    if (!emitter_initialized) {
+        k_timer_init(&emitter.timer, emitter_timer_expiry, NULL);
+        k_work_init(&emitter.work, emitter_work_handler);
+        emitter_initialized = true;
+    }
+    return 0;
+}
+
+#define TB_CMD_INST(n)                                                                             \
+    static const struct behavior_tb_cmd_config behavior_tb_cmd_config_##n = {                      \
+        .tap_ms = DT_INST_PROP(n, tap_ms),                                                         \
+        .wait_ms = DT_INST_PROP(n, wait_ms),                                                       \
+        .caps_tap_ms = DT_INST_PROP(n, caps_tap_ms),                                               \
+        .caps_wait_ms = DT_INST_PROP(n, caps_wait_ms),                                             \
+    };                                                                                             \
+    BEHAVIOR_DT_INST_DEFINE(n, behavior_tb_cmd_init, NULL, NULL, &behavior_tb_cmd_config_##n,      \
+                            POST_KERNEL, CONFIG_KERNEL_INIT_PRIORITY_DEFAULT,                      \
+                            &behavior_tb_cmd_driver_api);
+
+DT_INST_FOREACH_STATUS_OKAY(TB_CMD_INST)
+
+#endif
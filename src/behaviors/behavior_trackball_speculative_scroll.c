@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define DT_DRV_COMPAT zmk_behavior_trackball_speculative_scroll
+
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <drivers/behavior.h>
+#include <zmk/behavior.h>
+#include <zmk/hid_trackball.h>
+#include <zmk/event_manager.h>
+#include <zmk/events/position_state_changed.h>
+
+LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
+
+#if DT_HAS_COMPAT_STATUS_OKAY(DT_DRV_COMPAT)
+
+// Toggles scroll-mode as soon as the key goes down, so the trackball already
+// scrolls while a hold-tap would still be deciding. A tap is a toggle as well,
+// so it is left as it is, while a hold (held past the tapping term, or
+// interrupted by another key like a hold-preferred hold-tap) toggles back on
+// release.
+struct behavior_tb_spec_config {
+    const struct device *command_dev;
+    uint32_t toggle_command;
+    int tapping_term_ms;
+};
+
+struct behavior_tb_spec_data {
+    bool pressed;
+    bool interrupted;
+    uint32_t position;
+    int64_t press_timestamp;
+};
+
+#define TB_SPEC_DEV(n) DEVICE_DT_INST_GET(n),
+
+static const struct device *const tb_spec_devs[] = {DT_INST_FOREACH_STATUS_OKAY(TB_SPEC_DEV)};
+
+static int on_keymap_binding_pressed(struct zmk_behavior_binding *binding,
+                                     struct zmk_behavior_binding_event event) {
+    const struct device *dev = zmk_behavior_get_binding(binding->behavior_dev);
+    const struct behavior_tb_spec_config *config = dev->config;
+    struct behavior_tb_spec_data *data = dev->data;
+
+    data->pressed = true;
+    data->interrupted = false;
+    data->position = event.position;
+    data->press_timestamp = event.timestamp;
+    zmk_hid_trackball_command_send(config->command_dev, config->toggle_command);
+    return ZMK_BEHAVIOR_OPAQUE;
+}
+
+static int on_keymap_binding_released(struct zmk_behavior_binding *binding,
+                                      struct zmk_behavior_binding_event event) {
+    const struct device *dev = zmk_behavior_get_binding(binding->behavior_dev);
+    const struct behavior_tb_spec_config *config = dev->config;
+    struct behavior_tb_spec_data *data = dev->data;
+
+    if (!data->pressed) {
+        return ZMK_BEHAVIOR_OPAQUE;
+    }
+    data->pressed = false;
+    if (data->interrupted || event.timestamp - data->press_timestamp >= config->tapping_term_ms) {
+        zmk_hid_trackball_command_send(config->command_dev, config->toggle_command);
+    } else {
+        LOG_DBG("%s: tapped, keeping scroll-mode toggled", dev->name);
+    }
+    return ZMK_BEHAVIOR_OPAQUE;
+}
+
+static const struct behavior_driver_api behavior_tb_spec_driver_api = {
+    .binding_pressed = on_keymap_binding_pressed,
+    .binding_released = on_keymap_binding_released,
+};
+
+static int position_state_listener_cb(const zmk_event_t *eh) {
+    struct zmk_position_state_changed *ev = as_zmk_position_state_changed(eh);
+    if (!ev->state) {
+        return ZMK_EV_EVENT_BUBBLE;
+    }
+    for (int i = 0; i < ARRAY_SIZE(tb_spec_devs); i++) {
+        struct behavior_tb_spec_data *data = tb_spec_devs[i]->data;
+        if (data->pressed && ev->position != data->position) {
+            data->interrupted = true;
+        }
+    }
+    return ZMK_EV_EVENT_BUBBLE;
+}
+
+ZMK_LISTENER(behavior_tb_spec, position_state_listener_cb);
+ZMK_SUBSCRIPTION(behavior_tb_spec, zmk_position_state_changed);
+
+#define TB_SPEC_INST(n)                                                                            \
+    static const struct behavior_tb_spec_config behavior_tb_spec_config_##n = {                    \
+        .command_dev = DEVICE_DT_GET(DT_INST_PHANDLE(n, trackball_command)),                       \
+        .toggle_command = DT_INST_PROP(n, toggle_command),                                         \
+        .tapping_term_ms = DT_INST_PROP(n, tapping_term_ms),                                       \
+    };                                                                                             \
+    static struct behavior_tb_spec_data behavior_tb_spec_data_##n;                                 \
+    BEHAVIOR_DT_INST_DEFINE(n, NULL, NULL, &behavior_tb_spec_data_##n,                             \
+                            &behavior_tb_spec_config_##n, POST_KERNEL,                             \
+                            CONFIG_KERNEL_INIT_PRIORITY_DEFAULT, &behavior_tb_spec_driver_api);
+
+DT_INST_FOREACH_STATUS_OKAY(TB_SPEC_INST)
+
+#endif
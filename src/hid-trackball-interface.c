@@ -6,28 +6,87 @@
 
 #define DT_DRV_COMPAT zmk_hid_trackball_interface
 
+#include <string.h>
 #include <zephyr/device.h>
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 #include <zephyr/input/input.h>
 #include <zmk/behavior.h>
 #include <zmk/behavior_queue.h>
+#include <zmk/events/activity_state_changed.h>
+#include <zmk/events/endpoint_changed.h>
 #include <zmk/events/hid_indicators_changed.h>
+#include <zmk/events/keycode_state_changed.h>
 #include <zmk/events/layer_state_changed.h>
+#include <zmk/events/position_state_changed.h>
 #include <zmk/keymap.h>
 #include <zmk/activity.h>
+#include <zmk/hid_trackball.h>
+#include <dt-bindings/zmk/hid_usage.h>
+#include <dt-bindings/zmk/hid_usage_pages.h>
+#include <dt-bindings/zmk/keys.h>
 
 #if IS_ENABLED(CONFIG_ZMK_HID_TRACKBALL_INTERFACE_FEATURE_CHANNEL)
 #include <zephyr/usb/usb_device.h>
 #include <zephyr/usb/class/usb_hid.h>
+#include <zephyr/sys/byteorder.h>
 #endif
 
 LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 
 #if DT_HAS_COMPAT_STATUS_OKAY(DT_DRV_COMPAT)
 
+#define LED_NLCK 0x01
+#define LED_CLCK 0x02
 #define LED_SLCK 0x04
 
+// Fallback delay for the automouse layer after waking the keyboard, in case the
+// activity state change is never observed.
+#define AUTOMOUSE_WAKE_FALLBACK_MS 50
+
+// Scroll Lock edges caused by our own key presses (e.g. command frame markers)
+// are expected back from the host within this time, or within a few times the
+// echo time measured by the link probe. tools/led-link-sim has copies of these
+// and of the acknowledgement pulse timing below.
+#define LOCAL_SLCK_ECHO_TIMEOUT_MS 250
+#define LOCAL_SLCK_ECHO_MIN_MS 50
+
+// A command counts as delivered once the trackball acknowledged it, or (with
+// acknowledgements disabled) once the host echoed its closing frame marker.
+// Otherwise it is sent again after this timeout.
+#define COMMAND_TIMEOUT_MS 500
+#define COMMAND_MAX_ATTEMPTS 3
+
+// A command that couldn't be queued at all is tried again after this delay,
+// without counting as an attempt.
+#define COMMAND_SEND_RETRY_MS 50
+
+// The trackball acknowledges a command with a SLCK pulse that is
+// (mode + 1) units long.
+#define ACK_PULSE_UNIT_MS 15
+#define ACK_PULSE_MAX_MS (ACK_PULSE_UNIT_MS * (SNIPE + 2))
+
+// The adaptive automouse timeout is learned from the pauses after which the
+// mouse was moved again, kept in a histogram up to the maximum timeout. Old
+// pauses are halved away once a bucket fills up.
+#define AUTOMOUSE_GAP_BUCKETS 16
+#define AUTOMOUSE_GAP_MIN_SAMPLES 8
+
+// After the endpoint changes, the link probe taps Num Lock and Caps Lock and
+// times how long the host takes to echo each of them, then taps them again to
+// restore the LEDs. Scroll Lock isn't probed since its edges open frames. The
+// taps of one LED are kept apart so the trackball doesn't read them as a
+// command window.
+#define PROBE_DELAY_MS 500
+#define PROBE_HOLD_MS 5
+#define PROBE_ECHO_TIMEOUT_MS 250
+#define PROBE_SETTLE_MS 50
+
+// The probe waits for the lock keys of commands and user macros to finish. The
+// trackball drops an unfinished frame after this long without LED changes, so
+// no frame can be open once the lock keys stayed untouched for this long.
+#define PROBE_QUIET_MS 250
+
 enum interface_input_mode {
     MOVE,
     SCROLL,
@@ -35,146 +94,756 @@ enum interface_input_mode {
 };
 
 struct interface_config {
-    int32_t *scroll_layers;
-    int scroll_layers_len;
-    int32_t *snipe_layers;
-    int snipe_layers_len;
+    const char *set_mode_bindings[SNIPE + 1];
+    // Set for zmk,behavior-trackball-command bindings, which are sent directly
+    // instead of through the behavior queue.
+    const struct device *set_mode_emitters[SNIPE + 1];
+    uint32_t set_mode_params[SNIPE + 1];
+    zmk_keymap_layers_state_t scroll_layers;
+    zmk_keymap_layers_state_t snipe_layers;
+    bool snipe_priority;
     int32_t automouse_layer;
     int automouse_layer_timeout_ms;
+    int automouse_timeout_percentile;
+    int automouse_timeout_min_ms;
+    int automouse_timeout_max_ms;
+    const uint32_t *automouse_exit_positions;
+    size_t automouse_exit_positions_len;
+    int ack_timeout_ms;
+    int layer_settle_ms;
 };
 
 struct interface_data {
     const struct device *dev;
 
+    // Mode of the last command sent to the trackball, and the mode the
+    // current layers ask for.
     enum interface_input_mode curr_mode;
+    enum interface_input_mode target_mode;
+    int64_t target_timestamp;
+    uint8_t command_attempts;
+    uint16_t commands_sent;
+    uint16_t command_timeouts;
+    uint16_t command_retransmits;
+    uint16_t last_round_trip_ms;
+    // Time from the layer change to its command being queued, which grows
+    // while commands for other instances are in flight.
+    uint16_t last_command_latency_ms;
+
     bool automouse_enabled;
+    int64_t motion_stop_timestamp;
+    uint8_t gap_histogram[AUTOMOUSE_GAP_BUCKETS];
+    uint16_t gap_count;
     struct k_work_delayable activate_automouse_layer_delayed;
     struct k_work_delayable deactivate_automouse_layer_delayed;
+    struct k_work_delayable layer_settle_delayed;
 };
 
-static int32_t scroll_layers[] = DT_PROP(DT_DRV_INST(0), scroll_layers);
-static int32_t snipe_layers[] = DT_PROP(DT_DRV_INST(0), snipe_layers);
-
-static const struct interface_config config = {
-    .scroll_layers = scroll_layers,
-    .scroll_layers_len = DT_PROP_LEN(DT_DRV_INST(0), scroll_layers),
-    .snipe_layers = snipe_layers,
-    .snipe_layers_len = DT_PROP_LEN(DT_DRV_INST(0), snipe_layers),
-    .automouse_layer = DT_PROP(DT_DRV_INST(0), automouse_layer),
-    .automouse_layer_timeout_ms = DT_PROP(DT_DRV_INST(0), automouse_layer_timeout_ms),
+enum probe_state {
+    PROBE_IDLE,
+    PROBE_NEXT_TAP,
+    PROBE_RELEASE,
+    PROBE_WAIT_ECHO,
 };
 
-static struct interface_data data = {
-    .dev = DEVICE_DT_INST_GET(0),
+static const uint32_t probe_keys[] = {KP_NLCK, KP_NLCK, CLCK, CLCK};
+static const uint8_t probe_key_leds[] = {LED_NLCK, LED_NLCK, LED_CLCK, LED_CLCK};
+
+// All trackballs hang off the same lock LEDs, so the command in flight, the
+// acknowledgement window and the Scroll Lock bookkeeping are shared by every
+// instance.
+struct interface_link {
+    const struct device *command_dev;
+    int64_t command_timestamp;
+
+    // An acknowledgement is expected right after our frames, and a pulse that
+    // doesn't end in time was actual trackball motion.
+    bool ack_window_open;
+    int64_t ack_pulse_start;
+
+    bool host_slck;
+    uint8_t local_slck_edges;
+    int64_t local_slck_timestamp;
+    // Echoes of our frame markers since the command in flight was sent. Every
+    // frame has an opening and a closing marker, so every second one closes
+    // a frame.
+    uint8_t marker_echoes;
+
+    // Link probe state, and its results: the slowest indicator echo and the
+    // lock LEDs that were echoed at all. echo_ms is 0 until a probe succeeded.
+    uint8_t host_indicators;
+    int64_t lock_key_timestamp;
+    enum probe_state probe_state;
+    bool probe_tapping;
+    uint8_t probe_tap;
+    bool probe_echoed;
+    bool probe_restart;
+    int64_t probe_timestamp;
+    uint8_t probe_leds;
+    uint16_t probe_echo_ms;
+    uint16_t echo_ms;
+    uint8_t usable_leds;
 };
 
-static void toggle_scroll() {
-    struct zmk_behavior_binding binding = {
-        .behavior_dev = DEVICE_DT_NAME(DT_PHANDLE(DT_DRV_INST(0), tog_scroll_bindings)),
-    };
-    zmk_behavior_queue_add(-1, binding, true, 0);
-    LOG_INF("scroll toggled"); 
+static struct interface_link link;
+
+#define LAYER_BIT(node_id, prop, idx) | BIT(DT_PROP_BY_IDX(node_id, prop, idx))
+#define LAYERS_MASK(node_id, prop) (0 DT_FOREACH_PROP_ELEM(node_id, prop, LAYER_BIT))
+
+#define INTERFACE_DEV(n) DEVICE_DT_INST_GET(n),
+
+static const struct device *const interface_devs[] = {DT_INST_FOREACH_STATUS_OKAY(INTERFACE_DEV)};
+
+static int set_input_mode(const struct device *dev, enum interface_input_mode mode) {
+    const struct interface_config *config = dev->config;
+    int err;
+#if IS_ENABLED(CONFIG_ZMK_BEHAVIOR_TRACKBALL_COMMAND)
+    if (config->set_mode_emitters[mode]) {
+        err = zmk_hid_trackball_command_send(config->set_mode_emitters[mode],
+                                             config->set_mode_params[mode]);
+    } else
+#endif
+    {
+        struct zmk_behavior_binding binding = {
+            .behavior_dev = config->set_mode_bindings[mode],
+            .param1 = config->set_mode_params[mode],
+        };
+        err = zmk_behavior_queue_add(-1, binding, true, 0);
+    }
+    if (err) {
+        LOG_WRN("%s: input mode %d could not be sent (%d)", dev->name, mode, err);
+        return err;
+    }
+    LOG_INF("%s: input mode set to %d", dev->name, mode);
+    return 0;
+}
+
+static void command_timeout_work(struct k_work *item);
+static K_WORK_DELAYABLE_DEFINE(command_timeout_delayed, command_timeout_work);
+static void command_send_retry_work(struct k_work *item);
+static K_WORK_DELAYABLE_DEFINE(command_send_retry_delayed, command_send_retry_work);
+static void command_completed(void);
+
+// A command that was never queued isn't waited for like a lost one: a full
+// queue is simply tried again, and a command the queue refuses is given up.
+static void send_input_mode_command(const struct device *dev) {
+    struct interface_data *data = dev->data;
+
+    link.command_dev = dev;
+    int err = set_input_mode(dev, data->target_mode);
+    if (err && err != -EINVAL) {
+        k_work_reschedule(&command_send_retry_delayed, K_MSEC(COMMAND_SEND_RETRY_MS));
+        return;
+    }
+    data->curr_mode = data->target_mode;
+    if (err) {
+        data->command_timeouts++;
+        command_completed();
+        return;
+    }
+    data->commands_sent++;
+    link.command_timestamp = k_uptime_get();
+    link.marker_echoes = 0;
+    if (data->command_attempts == 1) {
+        data->last_command_latency_ms = link.command_timestamp - data->target_timestamp;
+    }
+    k_work_reschedule(&command_timeout_delayed, K_MSEC(COMMAND_TIMEOUT_MS));
+}
+
+// A probe tap waiting for its echo must not be mixed up with the taps of a
+// command. Between its taps the probe waits for commands instead.
+static bool probe_tap_in_flight(void) {
+    return link.probe_state == PROBE_RELEASE || link.probe_state == PROBE_WAIT_ECHO;
+}
+
+// Only one command is in the behavior queue at a time, for all instances.
+// Layer changes while it is in flight just update the target modes, so
+// superseded transitions are never sent and each trackball converges on the
+// latest one.
+static void update_input_mode(void) {
+    if (link.command_dev || probe_tap_in_flight()) {
+        return;
+    }
+    for (int i = 0; i < ARRAY_SIZE(interface_devs); i++) {
+        struct interface_data *data = interface_devs[i]->data;
+        if (data->target_mode != data->curr_mode) {
+            data->command_attempts = 1;
+            send_input_mode_command(interface_devs[i]);
+            return;
+        }
+    }
+}
+
+static void command_completed(void) {
+    k_work_cancel_delayable(&command_timeout_delayed);
+    k_work_cancel_delayable(&command_send_retry_delayed);
+    link.command_dev = NULL;
+    update_input_mode();
+}
+
+// The mode commands are absolute, so a lost command is simply sent again (for
+// the latest target mode).
+static void command_failed(void) {
+    const struct device *dev = link.command_dev;
+    struct interface_data *data = dev->data;
+
+    if (data->command_attempts < COMMAND_MAX_ATTEMPTS) {
+        data->command_attempts++;
+        data->command_retransmits++;
+        send_input_mode_command(dev);
+        return;
+    }
+    data->command_timeouts++;
+    command_completed();
+}
+
+static void command_timeout_work(struct k_work *item) {
+    LOG_WRN("%s: trackball command timed out", link.command_dev->name);
+    command_failed();
+}
+
+static void command_send_retry_work(struct k_work *item) {
+    if (link.command_dev) {
+        send_input_mode_command(link.command_dev);
+    }
+}
+
+static void ack_received(int64_t timestamp, int64_t width) {
+    if (!link.command_dev) {
+        return;
+    }
+    struct interface_data *data = link.command_dev->data;
+    int mode = (width + ACK_PULSE_UNIT_MS / 2) / ACK_PULSE_UNIT_MS - 1;
+    if (mode != data->curr_mode) {
+        LOG_WRN("%s: trackball acknowledged mode %d instead of %d", link.command_dev->name, mode,
+                data->curr_mode);
+        command_failed();
+        return;
+    }
+    data->last_round_trip_ms = timestamp - link.command_timestamp;
+    LOG_INF("%s: trackball acknowledged mode %d after %d ms", link.command_dev->name, mode,
+            data->last_round_trip_ms);
+    command_completed();
 }
 
-static void cycle_dpi() {
-    struct zmk_behavior_binding binding = {
-        .behavior_dev = DEVICE_DT_NAME(DT_PHANDLE(DT_DRV_INST(0), cyc_dpi_bindings)),
-    };
-    zmk_behavior_queue_add(-1, binding, true, 0);
-    LOG_INF("cycle dpi");
+static void ack_window_work(struct k_work *item) {
+    link.ack_window_open = false;
+    if (link.command_dev) {
+        LOG_WRN("%s: no acknowledgement from trackball", link.command_dev->name);
+        command_failed();
+    }
+}
+
+static K_WORK_DELAYABLE_DEFINE(ack_window_delayed, ack_window_work);
+
+// Frames sent by the user's own bindings can't be told apart, so they wait
+// for the longest acknowledgement any of the trackballs may send. The pulse
+// makes a round trip through the host, so a slow host stretches the window.
+static int ack_timeout_ms(void) {
+    int timeout_ms = 0;
+    if (link.command_dev) {
+        const struct interface_config *config = link.command_dev->config;
+        timeout_ms = config->ack_timeout_ms;
+    } else {
+        for (int i = 0; i < ARRAY_SIZE(interface_devs); i++) {
+            const struct interface_config *config = interface_devs[i]->config;
+            timeout_ms = MAX(timeout_ms, config->ack_timeout_ms);
+        }
+    }
+    return timeout_ms > 0 ? MAX(timeout_ms, 2 * link.echo_ms) : 0;
+}
+
+static int local_slck_echo_timeout_ms(void) {
+    if (link.echo_ms == 0) {
+        return LOCAL_SLCK_ECHO_TIMEOUT_MS;
+    }
+    return MAX(LOCAL_SLCK_ECHO_MIN_MS, 3 * link.echo_ms);
+}
+
+static void frame_marker_echoed(void) {
+    int timeout_ms = ack_timeout_ms();
+    if (timeout_ms > 0) {
+        link.ack_window_open = true;
+        k_work_reschedule(&ack_window_delayed, K_MSEC(timeout_ms));
+    } else if (link.command_dev) {
+        command_completed();
+    }
 }
 
 static void activate_automouse_layer_work(struct k_work *item) {
-    zmk_keymap_layer_activate(config.automouse_layer);
-    LOG_INF("mouse layer activated (after idle wake)");
-    data.automouse_enabled = true;
+    struct k_work_delayable *delayed = k_work_delayable_from_work(item);
+    struct interface_data *data =
+        CONTAINER_OF(delayed, struct interface_data, activate_automouse_layer_delayed);
+    const struct interface_config *config = data->dev->config;
+
+    zmk_keymap_layer_activate(config->automouse_layer);
+    LOG_INF("%s: mouse layer activated (after idle wake)", data->dev->name);
+    data->automouse_enabled = true;
 }
 
-static void activate_automouse_layer() {
+static void activate_automouse_layer(const struct device *dev) {
+    struct interface_data *data = dev->data;
+    const struct interface_config *config = dev->config;
+
     if (zmk_activity_get_state() != ZMK_ACTIVITY_ACTIVE) {
         // Keyboard is idle/sleeping. Emit synthetic input event to wake it,
-        // then delay layer activation so activity system processes first.
-        input_report_rel(data.dev, INPUT_REL_MISC, 1, true, K_NO_WAIT);
-        k_work_schedule(&data.activate_automouse_layer_delayed, K_MSEC(50));
-        LOG_INF("waking from idle, delaying automouse activation");
+        // the layer is activated as soon as the activity state becomes active.
+        k_work_schedule(&data->activate_automouse_layer_delayed, K_MSEC(AUTOMOUSE_WAKE_FALLBACK_MS));
+        input_report_rel(dev, INPUT_REL_MISC, 1, true, K_NO_WAIT);
+        LOG_INF("%s: waking from idle, delaying automouse activation", dev->name);
+    } else {
+        zmk_keymap_layer_activate(config->automouse_layer);
+        LOG_INF("%s: mouse layer activated", dev->name);
+        data->automouse_enabled = true;
+    }
+}
+
+static int activity_state_listener_cb(const zmk_event_t *eh) {
+    struct zmk_activity_state_changed *ev = as_zmk_activity_state_changed(eh);
+    if (ev->state != ZMK_ACTIVITY_ACTIVE) {
+        return 0;
+    }
+    for (int i = 0; i < ARRAY_SIZE(interface_devs); i++) {
+        struct interface_data *data = interface_devs[i]->data;
+        if (k_work_delayable_is_pending(&data->activate_automouse_layer_delayed)) {
+            k_work_reschedule(&data->activate_automouse_layer_delayed, K_NO_WAIT);
+        }
+    }
+    return 0;
+}
+
+ZMK_LISTENER(activity_state_listener, activity_state_listener_cb);
+ZMK_SUBSCRIPTION(activity_state_listener, zmk_activity_state_changed);
+
+static void deactivate_automouse_layer(const struct device *dev) {
+    struct interface_data *data = dev->data;
+    const struct interface_config *config = dev->config;
+
+    if (zmk_keymap_layer_active(config->automouse_layer)) {
+        zmk_keymap_layer_deactivate(config->automouse_layer);
+        LOG_INF("%s: mouse layer deactivated", dev->name);
+    }
+    data->automouse_enabled = false;
+}
+
+static void deactivate_automouse_layer_work(struct k_work *item) {
+    struct k_work_delayable *delayed = k_work_delayable_from_work(item);
+    struct interface_data *data =
+        CONTAINER_OF(delayed, struct interface_data, deactivate_automouse_layer_delayed);
+
+    deactivate_automouse_layer(data->dev);
+}
+
+static bool binding_is_transparent(const struct zmk_behavior_binding *binding) {
+    if (binding == NULL || binding->behavior_dev == NULL) {
+        return true;
+    }
+    // &trans is dropped from the devicetree unless the keymap uses it.
+#if DT_NODE_EXISTS(DT_NODELABEL(trans))
+    return strcmp(binding->behavior_dev, DEVICE_DT_NAME(DT_NODELABEL(trans))) == 0;
+#else
+    return false;
+#endif
+}
+
+static bool automouse_exit_position(const struct device *dev, uint32_t position) {
+    const struct interface_config *config = dev->config;
+
+    for (int i = 0; i < config->automouse_exit_positions_len; i++) {
+        if (config->automouse_exit_positions[i] == position) {
+            return true;
+        }
+    }
+    return binding_is_transparent(
+        zmk_keymap_get_layer_binding_at_idx(config->automouse_layer, position));
+}
+
+// Typing right after moving the mouse turns the automouse layer off at once.
+// ZMK runs listeners in the order of their names, so this one has to sort
+// before "keymap" to see the press before the keymap resolves it. The press
+// is held back until the layer is off and then released to the listeners
+// after this one, so the key is taken from the layers below.
+static int hid_trackball_position_listener_cb(const zmk_event_t *eh) {
+    struct zmk_position_state_changed *ev = as_zmk_position_state_changed(eh);
+    if (!ev->state) {
+        return ZMK_EV_EVENT_BUBBLE;
+    }
+    bool deactivated = false;
+    for (int i = 0; i < ARRAY_SIZE(interface_devs); i++) {
+        struct interface_data *data = interface_devs[i]->data;
+        if (!data->automouse_enabled || !automouse_exit_position(interface_devs[i], ev->position)) {
+            continue;
+        }
+        k_work_cancel_delayable(&data->deactivate_automouse_layer_delayed);
+        deactivate_automouse_layer(interface_devs[i]);
+        // Typing isn't a pause the automouse layer should have lasted through.
+        data->motion_stop_timestamp = 0;
+        deactivated = true;
+    }
+    if (!deactivated) {
+        return ZMK_EV_EVENT_BUBBLE;
+    }
+
+    struct zmk_position_state_changed_event captured = copy_raised_zmk_position_state_changed(ev);
+    ZMK_EVENT_RELEASE(captured);
+    return ZMK_EV_EVENT_CAPTURED;
+}
+
+ZMK_LISTENER(hid_trackball_position_listener, hid_trackball_position_listener_cb);
+ZMK_SUBSCRIPTION(hid_trackball_position_listener, zmk_position_state_changed);
+
+static int automouse_gap_bucket_ms(const struct interface_config *config) {
+    return DIV_ROUND_UP(config->automouse_timeout_max_ms, AUTOMOUSE_GAP_BUCKETS);
+}
+
+static void record_automouse_gap(const struct device *dev, int64_t gap_ms) {
+    struct interface_data *data = dev->data;
+    const struct interface_config *config = dev->config;
+
+    // Longer pauses still count, as pauses the longest timeout should cover.
+    int index = MIN(gap_ms / automouse_gap_bucket_ms(config), AUTOMOUSE_GAP_BUCKETS - 1);
+    uint8_t *bucket = &data->gap_histogram[index];
+    if (*bucket == UINT8_MAX) {
+        data->gap_count = 0;
+        for (int i = 0; i < AUTOMOUSE_GAP_BUCKETS; i++) {
+            data->gap_histogram[i] /= 2;
+            data->gap_count += data->gap_histogram[i];
+        }
+    }
+    (*bucket)++;
+    data->gap_count++;
+}
+
+static int automouse_timeout_ms(const struct device *dev) {
+    struct interface_data *data = dev->data;
+    const struct interface_config *config = dev->config;
+
+    if (config->automouse_timeout_percentile == 0 ||
+        data->gap_count < AUTOMOUSE_GAP_MIN_SAMPLES) {
+        return config->automouse_layer_timeout_ms;
+    }
+
+    uint32_t wanted = DIV_ROUND_UP(data->gap_count * config->automouse_timeout_percentile, 100);
+    uint32_t seen = 0;
+    int bucket = 0;
+    while (bucket < AUTOMOUSE_GAP_BUCKETS - 1) {
+        seen += data->gap_histogram[bucket];
+        if (seen >= wanted) {
+            break;
+        }
+        bucket++;
+    }
+    return CLAMP((bucket + 1) * automouse_gap_bucket_ms(config), config->automouse_timeout_min_ms,
+                 config->automouse_timeout_max_ms);
+}
+
+static void automouse_motion_changed(const struct device *dev, bool moving) {
+    struct interface_data *data = dev->data;
+    const struct interface_config *config = dev->config;
+
+    if (config->automouse_layer < 0) {
+        return;
+    }
+    if (moving && data->motion_stop_timestamp != 0) {
+        record_automouse_gap(dev, k_uptime_get() - data->motion_stop_timestamp);
+        data->motion_stop_timestamp = 0;
+    }
+    if (moving) {
+        if (!data->automouse_enabled && !zmk_keymap_layer_active(config->automouse_layer)) {
+            activate_automouse_layer(dev);
+        } else if (k_work_delayable_is_pending(&data->deactivate_automouse_layer_delayed)) {
+            k_work_cancel_delayable(&data->deactivate_automouse_layer_delayed);
+        }
+    } else if (data->automouse_enabled) {
+        data->motion_stop_timestamp = k_uptime_get();
+        k_work_reschedule(&data->deactivate_automouse_layer_delayed,
+                          K_MSEC(automouse_timeout_ms(dev)));
+    }
+}
+
+// The Scroll Lock motion signal is the same for all trackballs, so every
+// instance with an automouse layer follows it.
+static void trackball_motion_changed(bool moving) {
+    for (int i = 0; i < ARRAY_SIZE(interface_devs); i++) {
+        automouse_motion_changed(interface_devs[i], moving);
+    }
+}
+
+static void ack_pulse_work(struct k_work *item) {
+    link.ack_pulse_start = 0;
+    trackball_motion_changed(link.host_slck);
+    if (link.command_dev) {
+        command_failed();
+    }
+}
+
+static K_WORK_DELAYABLE_DEFINE(ack_pulse_delayed, ack_pulse_work);
+
+// Returns true if the SLCK edge belongs to an acknowledgement pulse.
+static bool handle_ack_edge(void) {
+    int64_t now = k_uptime_get();
+
+    if (link.ack_pulse_start != 0) {
+        int64_t start = link.ack_pulse_start;
+        link.ack_pulse_start = 0;
+        k_work_cancel_delayable(&ack_pulse_delayed);
+        ack_received(start, now - start);
+        return true;
+    }
+    if (link.ack_window_open) {
+        link.ack_window_open = false;
+        k_work_cancel_delayable(&ack_window_delayed);
+        link.ack_pulse_start = now;
+        k_work_reschedule(&ack_pulse_delayed, K_MSEC(ACK_PULSE_MAX_MS));
+        return true;
+    }
+    return false;
+}
+
+uint16_t zmk_hid_trackball_echo_ms(void) {
+    return link.echo_ms;
+}
+
+uint8_t zmk_hid_trackball_usable_leds(void) {
+    return link.usable_leds;
+}
+
+static void probe_work(struct k_work *item);
+static K_WORK_DELAYABLE_DEFINE(probe_delayed, probe_work);
+static void probe_schedule(void);
+
+static void probe_finished(void) {
+    link.probe_state = PROBE_IDLE;
+    if (link.probe_leds == 0) {
+        // Nothing came back, the host probably isn't listening (yet).
+        LOG_WRN("link probe: no indicator echoed, using the default timing");
+        link.usable_leds = 0;
+        link.echo_ms = 0;
     } else {
-        zmk_keymap_layer_activate(config.automouse_layer);
-        LOG_INF("mouse layer activated");
-        data.automouse_enabled = true;
+        link.usable_leds = link.probe_leds;
+        link.echo_ms = MAX(link.probe_echo_ms, 1);
+        LOG_INF("link probe: echo within %d ms, usable leds 0x%02x", link.echo_ms,
+                link.usable_leds);
+        if (!(link.usable_leds & LED_CLCK)) {
+            // Some hosts ignore short Caps Lock taps, commands keep the slow ones there.
+            LOG_WRN("link probe: short caps lock taps aren't echoed");
+        }
+    }
+    if (link.probe_restart) {
+        link.probe_restart = false;
+        probe_schedule();
+        return;
+    }
+    update_input_mode();
+}
+
+static void probe_next_tap(void) {
+    link.probe_tap++;
+    link.probe_state = PROBE_NEXT_TAP;
+    k_work_reschedule(&probe_delayed, K_MSEC(PROBE_SETTLE_MS));
+    update_input_mode();
+}
+
+// Commands of this module, of &tb_cmd and of the user's macros all tap the
+// lock keys, and a probe tap in between would corrupt their frames.
+static bool lock_keys_busy(void) {
+    if (link.command_dev || link.local_slck_edges > 0) {
+        return true;
+    }
+#if IS_ENABLED(CONFIG_ZMK_BEHAVIOR_TRACKBALL_COMMAND)
+    if (!zmk_hid_trackball_command_idle()) {
+        return true;
+    }
+#endif
+    return k_uptime_get() - link.lock_key_timestamp < PROBE_QUIET_MS + link.echo_ms;
+}
+
+static void probe_raise(bool pressed, int64_t timestamp) {
+    link.probe_tapping = true;
+    raise_zmk_keycode_state_changed_from_encoded(probe_keys[link.probe_tap], pressed, timestamp);
+    link.probe_tapping = false;
+}
+
+static void probe_work(struct k_work *item) {
+    int64_t now = k_uptime_get();
+
+    switch (link.probe_state) {
+    case PROBE_NEXT_TAP:
+        if (link.probe_tap == ARRAY_SIZE(probe_keys)) {
+            probe_finished();
+            return;
+        }
+        if (lock_keys_busy()) {
+            k_work_reschedule(&probe_delayed, K_MSEC(PROBE_SETTLE_MS));
+            return;
+        }
+        link.probe_echoed = false;
+        link.probe_timestamp = now;
+        link.probe_state = PROBE_RELEASE;
+        probe_raise(true, now);
+        k_work_reschedule(&probe_delayed, K_MSEC(PROBE_HOLD_MS));
+        return;
+    case PROBE_RELEASE:
+        probe_raise(false, now);
+        if (link.probe_echoed) {
+            probe_next_tap();
+            return;
+        }
+        link.probe_state = PROBE_WAIT_ECHO;
+        k_work_reschedule(&probe_delayed, K_MSEC(PROBE_ECHO_TIMEOUT_MS - PROBE_HOLD_MS));
+        return;
+    case PROBE_WAIT_ECHO:
+        LOG_DBG("link probe: no echo for led 0x%02x", probe_key_leds[link.probe_tap]);
+        link.probe_leds &= ~probe_key_leds[link.probe_tap];
+        probe_next_tap();
+        return;
+    case PROBE_IDLE:
+        return;
     }
 }
 
-static void deactivate_automouse_layer(struct k_work *item) {
-    if (zmk_keymap_layer_active(config.automouse_layer)) {
-        zmk_keymap_layer_deactivate(config.automouse_layer);
-        LOG_INF("mouse layer deactivated");
+static void probe_echo(uint8_t changed) {
+    if (!probe_tap_in_flight()) {
+        return;
+    }
+    if (link.probe_echoed || !(changed & probe_key_leds[link.probe_tap])) {
+        return;
+    }
+    link.probe_echoed = true;
+    link.probe_echo_ms = MAX(link.probe_echo_ms, k_uptime_get() - link.probe_timestamp);
+    if (link.probe_state == PROBE_WAIT_ECHO) {
+        probe_next_tap();
     }
-    data.automouse_enabled = false;
 }
 
+static void probe_schedule(void) {
+    link.probe_state = PROBE_NEXT_TAP;
+    link.probe_tap = 0;
+    link.probe_leds = LED_NLCK | LED_CLCK;
+    link.probe_echo_ms = 0;
+    k_work_reschedule(&probe_delayed, K_MSEC(PROBE_DELAY_MS));
+}
+
+static int endpoint_listener_cb(const zmk_event_t *eh) {
+    if (!IS_ENABLED(CONFIG_ZMK_HID_TRACKBALL_INTERFACE_LINK_PROBE)) {
+        return 0;
+    }
+    if (link.probe_state == PROBE_IDLE || link.probe_state == PROBE_NEXT_TAP) {
+        probe_schedule();
+    } else {
+        // Let the key in flight finish, then start over on the new endpoint.
+        link.probe_restart = true;
+    }
+    return 0;
+}
+
+ZMK_LISTENER(endpoint_listener, endpoint_listener_cb);
+ZMK_SUBSCRIPTION(endpoint_listener, zmk_endpoint_changed);
+
 static int hid_indicators_listener_cb(const zmk_event_t *eh) {
     struct zmk_hid_indicators_changed *ev = as_zmk_hid_indicators_changed(eh);
-    if (ev->indicators & LED_SLCK) {
-        if (!data.automouse_enabled && !zmk_keymap_layer_active(config.automouse_layer)) {
-            activate_automouse_layer();
-        } else if (k_work_delayable_is_pending(&data.deactivate_automouse_layer_delayed)) {
-            k_work_cancel_delayable(&data.deactivate_automouse_layer_delayed);
+    uint8_t changed = ev->indicators ^ link.host_indicators;
+    link.host_indicators = ev->indicators;
+    probe_echo(changed);
+
+    bool slck = ev->indicators & LED_SLCK;
+    if (slck == link.host_slck) {
+        return 0;
+    }
+    link.host_slck = slck;
+
+    // Our own SLCK taps frame trackball commands, they don't mean the trackball moved.
+    if (link.local_slck_edges > 0 &&
+        k_uptime_get() - link.local_slck_timestamp < local_slck_echo_timeout_ms()) {
+        link.local_slck_edges--;
+        link.marker_echoes++;
+        // The trackball only acknowledges a frame once it got the closing
+        // marker, however long the frame took to send.
+        if (link.marker_echoes % 2 == 0) {
+            frame_marker_echoed();
         }
-    } else if (data.automouse_enabled && !(ev->indicators & LED_SLCK)) {
-        k_work_reschedule(&data.deactivate_automouse_layer_delayed, K_MSEC(config.automouse_layer_timeout_ms));
+        return 0;
+    }
+    if (link.local_slck_edges > 0) {
+        // A marker echo got lost, start counting frames afresh.
+        link.local_slck_edges = 0;
+        link.marker_echoes = 0;
+    }
+
+    if (handle_ack_edge()) {
+        return 0;
     }
+    trackball_motion_changed(slck);
     return 0;
 }
 
 ZMK_LISTENER(hid_indicators_listener, hid_indicators_listener_cb);
 ZMK_SUBSCRIPTION(hid_indicators_listener, zmk_hid_indicators_changed);
 
-static enum interface_input_mode get_input_mode_for_current_layer() {
-    for (int i = 0; i < config.scroll_layers_len; i++) {
-        if (zmk_keymap_layer_active(config.scroll_layers[i])) {
-            return SCROLL;
-        }
+static int keycode_state_listener_cb(const zmk_event_t *eh) {
+    struct zmk_keycode_state_changed *ev = as_zmk_keycode_state_changed(eh);
+    if (ev->usage_page != HID_USAGE_KEY) {
+        return 0;
     }
-    for (int i = 0; i < config.snipe_layers_len; i++) {
-        if (zmk_keymap_layer_active(config.snipe_layers[i])) {
-            return SNIPE;
-        }
+    if (ev->state && ev->keycode == HID_USAGE_KEY_KEYBOARD_SCROLL_LOCK) {
+        link.local_slck_edges++;
+        link.local_slck_timestamp = k_uptime_get();
+    }
+    if (!link.probe_tapping && (ev->keycode == HID_USAGE_KEY_KEYBOARD_SCROLL_LOCK ||
+                                ev->keycode == HID_USAGE_KEY_KEYBOARD_CAPS_LOCK ||
+                                ev->keycode == HID_USAGE_KEY_KEYPAD_NUM_LOCK_AND_CLEAR)) {
+        link.lock_key_timestamp = k_uptime_get();
+    }
+    return 0;
+}
+
+ZMK_LISTENER(keycode_state_listener, keycode_state_listener_cb);
+ZMK_SUBSCRIPTION(keycode_state_listener, zmk_keycode_state_changed);
+
+static enum interface_input_mode get_input_mode_for_current_layer(const struct device *dev) {
+    const struct interface_config *config = dev->config;
+    zmk_keymap_layers_state_t state = zmk_keymap_layer_state() | BIT(zmk_keymap_layer_default());
+    bool scroll = state & config->scroll_layers;
+    bool snipe = state & config->snipe_layers;
+
+    if (scroll && !(snipe && config->snipe_priority)) {
+        return SCROLL;
+    }
+    return snipe ? SNIPE : MOVE;
+}
+
+static void update_target_mode(const struct device *dev) {
+    struct interface_data *data = dev->data;
+    enum interface_input_mode mode = get_input_mode_for_current_layer(dev);
+
+    if (mode != data->target_mode) {
+        data->target_mode = mode;
+        data->target_timestamp = k_uptime_get();
     }
-    return MOVE;
 }
 
+static void layer_settle_work(struct k_work *item) {
+    struct k_work_delayable *delayed = k_work_delayable_from_work(item);
+    struct interface_data *data =
+        CONTAINER_OF(delayed, struct interface_data, layer_settle_delayed);
+
+    update_target_mode(data->dev);
+    update_input_mode();
+}
+
+// With a settle time, every layer change restarts the wait, so a burst of
+// changes only leads to (at most) one command for the state it ends in.
 static int layer_state_listener_cb(const zmk_event_t *eh) {
-    enum interface_input_mode input_mode = get_input_mode_for_current_layer();
-    if (input_mode != data.curr_mode) {
-        LOG_INF("input mode changed to %d", input_mode);
-
-        switch (input_mode) {
-            case MOVE:
-                if (data.curr_mode == SCROLL) {
-                    toggle_scroll();
-                } else if (data.curr_mode == SNIPE) {
-                    cycle_dpi();
-                }
-                break;
-            case SCROLL:
-                if (data.curr_mode == MOVE) {
-                    toggle_scroll();
-                } else if (data.curr_mode == SNIPE) {
-                    cycle_dpi();
-                    toggle_scroll();
-                }
-                break;
-            case SNIPE:
-                if (data.curr_mode == MOVE) {
-                    cycle_dpi();
-                } else if (data.curr_mode == SCROLL) {
-                    toggle_scroll();
-                    cycle_dpi();
-                }
-                break;
+    for (int i = 0; i < ARRAY_SIZE(interface_devs); i++) {
+        const struct interface_config *config = interface_devs[i]->config;
+        struct interface_data *data = interface_devs[i]->data;
+        if (config->layer_settle_ms > 0) {
+            k_work_reschedule(&data->layer_settle_delayed, K_MSEC(config->layer_settle_ms));
+        } else {
+            update_target_mode(interface_devs[i]);
         }
-        data.curr_mode = input_mode;
     }
+    update_input_mode();
     return 0;
 }
 
@@ -184,13 +853,64 @@ ZMK_SUBSCRIPTION(layer_state_listener, zmk_layer_state_changed);
 static int interface_init(const struct device *dev) {
     struct interface_data *data = dev->data;
 
+    data->dev = dev;
     k_work_init_delayable(&data->activate_automouse_layer_delayed, activate_automouse_layer_work);
-    k_work_init_delayable(&data->deactivate_automouse_layer_delayed, deactivate_automouse_layer);
+    k_work_init_delayable(&data->deactivate_automouse_layer_delayed,
+                          deactivate_automouse_layer_work);
+    k_work_init_delayable(&data->layer_settle_delayed, layer_settle_work);
 
     return 0;
 }
 
-DEVICE_DT_INST_DEFINE(0, &interface_init, NULL, &data, &config, POST_KERNEL, CONFIG_APPLICATION_INIT_PRIORITY, NULL);
+#define SET_MODE_EMITTER(n, prop)                                                                  \
+    COND_CODE_1(DT_NODE_HAS_COMPAT(DT_INST_PHANDLE(n, prop), zmk_behavior_trackball_command),      \
+                (DEVICE_DT_GET(DT_INST_PHANDLE(n, prop))), (NULL))
+#define SET_MODE_PARAM(n, prop) DT_INST_PHA_BY_IDX_OR(n, prop, 0, param1, 0)
+
+#define INTERFACE_INST(n)                                                                          \
+    BUILD_ASSERT(!DT_INST_NODE_HAS_PROP(n, tog_scroll_bindings) &&                                 \
+                     !DT_INST_NODE_HAS_PROP(n, cyc_dpi_bindings),                                  \
+                 "tog-scroll-bindings and cyc-dpi-bindings are no longer used, remove them and "   \
+                 "set set-move-bindings, set-scroll-bindings and set-snipe-bindings instead");     \
+    static const uint32_t automouse_exit_positions_##n[] =                                         \
+        DT_INST_PROP(n, automouse_exit_positions);                                                 \
+    static const struct interface_config interface_config_##n = {                                 \
+        .set_mode_bindings =                                                                       \
+            {                                                                                      \
+                [MOVE] = DEVICE_DT_NAME(DT_INST_PHANDLE(n, set_move_bindings)),                    \
+                [SCROLL] = DEVICE_DT_NAME(DT_INST_PHANDLE(n, set_scroll_bindings)),                \
+                [SNIPE] = DEVICE_DT_NAME(DT_INST_PHANDLE(n, set_snipe_bindings)),                  \
+            },                                                                                     \
+        .set_mode_emitters =                                                                       \
+            {                                                                                      \
+                [MOVE] = SET_MODE_EMITTER(n, set_move_bindings),                                   \
+                [SCROLL] = SET_MODE_EMITTER(n, set_scroll_bindings),                               \
+                [SNIPE] = SET_MODE_EMITTER(n, set_snipe_bindings),                                 \
+            },                                                                                     \
+        .set_mode_params =                                                                         \
+            {                                                                                      \
+                [MOVE] = SET_MODE_PARAM(n, set_move_bindings),                                     \
+                [SCROLL] = SET_MODE_PARAM(n, set_scroll_bindings),                                 \
+                [SNIPE] = SET_MODE_PARAM(n, set_snipe_bindings),                                   \
+            },                                                                                     \
+        .scroll_layers = LAYERS_MASK(DT_DRV_INST(n), scroll_layers),                               \
+        .snipe_layers = LAYERS_MASK(DT_DRV_INST(n), snipe_layers),                                 \
+        .snipe_priority = DT_INST_PROP(n, snipe_priority),                                         \
+        .automouse_layer = DT_INST_PROP(n, automouse_layer),                                       \
+        .automouse_layer_timeout_ms = DT_INST_PROP(n, automouse_layer_timeout_ms),                 \
+        .automouse_timeout_percentile = DT_INST_PROP(n, automouse_timeout_percentile),             \
+        .automouse_timeout_min_ms = DT_INST_PROP(n, automouse_timeout_min_ms),                     \
+        .automouse_timeout_max_ms = DT_INST_PROP(n, automouse_timeout_max_ms),                     \
+        .automouse_exit_positions = automouse_exit_positions_##n,                                  \
+        .automouse_exit_positions_len = DT_INST_PROP_LEN(n, automouse_exit_positions),             \
+        .ack_timeout_ms = DT_INST_PROP(n, ack_timeout_ms),                                         \
+        .layer_settle_ms = DT_INST_PROP(n, layer_settle_ms),                                       \
+    };                                                                                             \
+    static struct interface_data interface_data_##n;                                               \
+    DEVICE_DT_INST_DEFINE(n, &interface_init, NULL, &interface_data_##n, &interface_config_##n,    \
+                          POST_KERNEL, CONFIG_APPLICATION_INIT_PRIORITY, NULL);
+
+DT_INST_FOREACH_STATUS_OKAY(INTERFACE_INST)
 
 #if IS_ENABLED(CONFIG_ZMK_HID_TRACKBALL_INTERFACE_FEATURE_CHANNEL)
 
@@ -204,10 +924,87 @@ static const uint8_t vendor_hid_report_desc[] = {
     0x75, 0x08,        //   Report Size (8)
     0x95, 0x01,        //   Report Count (1)
     0xB1, 0x02,        //   Feature (Data, Variable, Absolute)
+    0x85, 0x02,        //   Report ID (2)
+    0x09, 0x02,        //   Usage (Vendor Usage 2)
+    0x95, 0x11,        //   Report Count (17)
+    0xB1, 0x02,        //   Feature (Data, Variable, Absolute)
     0xC0,              // End Collection
 };
 
+#define VENDOR_REPORT_ID_MOTION 0x01
+#define VENDOR_REPORT_ID_STATE 0x02
+
+// Layout of the state report (after the report ID):
+//   [0]    report version
+//   [1]    mode of the last command sent to the trackball
+//   [2]    mode the current layers ask for
+//   [3]    flags, see VENDOR_STATE_*
+//   [4..5] commands sent (LE)
+//   [6..7] commands given up on (LE)
+//   [8..9] commands sent again (LE)
+//   [10..11] last acknowledgement round trip in ms (LE)
+//   [12..13] last layer change to command latency in ms (LE)
+//   [14..15] indicator echo time measured by the link probe in ms (LE), 0 if unknown
+//   [16]   lock LEDs the host echoed during the link probe
+#define VENDOR_STATE_VERSION 4
+#define VENDOR_STATE_LEN 17
+
+#define VENDOR_STATE_AUTOMOUSE_ENABLED BIT(0)
+#define VENDOR_STATE_AUTOMOUSE_LAYER_ACTIVE BIT(1)
+#define VENDOR_STATE_ACTIVATE_PENDING BIT(2)
+#define VENDOR_STATE_DEACTIVATE_PENDING BIT(3)
+#define VENDOR_STATE_COMMAND_IN_FLIGHT BIT(4)
+
 static const struct device *vendor_hid_dev;
+static uint8_t vendor_state_report[1 + VENDOR_STATE_LEN];
+
+static int vendor_get_report_cb(const struct device *dev,
+                                struct usb_setup_packet *setup,
+                                int32_t *len, uint8_t **buf) {
+    if ((setup->wValue & 0xFF) != VENDOR_REPORT_ID_STATE) {
+        return -ENOTSUP;
+    }
+
+    // The report describes the first trackball interface.
+    const struct device *tb_dev = interface_devs[0];
+    struct interface_data *data = tb_dev->data;
+    const struct interface_config *config = tb_dev->config;
+
+    uint8_t flags = 0;
+    if (data->automouse_enabled) {
+        flags |= VENDOR_STATE_AUTOMOUSE_ENABLED;
+    }
+    if (zmk_keymap_layer_active(config->automouse_layer)) {
+        flags |= VENDOR_STATE_AUTOMOUSE_LAYER_ACTIVE;
+    }
+    if (k_work_delayable_is_pending(&data->activate_automouse_layer_delayed)) {
+        flags |= VENDOR_STATE_ACTIVATE_PENDING;
+    }
+    if (k_work_delayable_is_pending(&data->deactivate_automouse_layer_delayed)) {
+        flags |= VENDOR_STATE_DEACTIVATE_PENDING;
+    }
+    if (link.command_dev == tb_dev) {
+        flags |= VENDOR_STATE_COMMAND_IN_FLIGHT;
+    }
+
+    uint8_t *report = vendor_state_report;
+    report[0] = VENDOR_REPORT_ID_STATE;
+    report[1] = VENDOR_STATE_VERSION;
+    report[2] = data->curr_mode;
+    report[3] = data->target_mode;
+    report[4] = flags;
+    sys_put_le16(data->commands_sent, &report[5]);
+    sys_put_le16(data->command_timeouts, &report[7]);
+    sys_put_le16(data->command_retransmits, &report[9]);
+    sys_put_le16(data->last_round_trip_ms, &report[11]);
+    sys_put_le16(data->last_command_latency_ms, &report[13]);
+    sys_put_le16(link.echo_ms, &report[15]);
+    report[17] = link.usable_leds;
+
+    *buf = report;
+    *len = sizeof(vendor_state_report);
+    return 0;
+}
 
 static int vendor_set_report_cb(const struct device *dev,
                                 struct usb_setup_packet *setup,
@@ -215,22 +1012,17 @@ static int vendor_set_report_cb(const struct device *dev,
     if (*len < 2) {
         return -EINVAL;
     }
+    if ((*buf)[0] != VENDOR_REPORT_ID_MOTION) {
+        return -ENOTSUP;
+    }
     uint8_t report_data = (*buf)[1]; // byte after report ID
 
-    if (report_data & LED_SLCK) {
-        if (!data.automouse_enabled && !zmk_keymap_layer_active(config.automouse_layer)) {
-            activate_automouse_layer();
-        } else if (k_work_delayable_is_pending(&data.deactivate_automouse_layer_delayed)) {
-            k_work_cancel_delayable(&data.deactivate_automouse_layer_delayed);
-        }
-    } else if (data.automouse_enabled) {
-        k_work_reschedule(&data.deactivate_automouse_layer_delayed,
-                          K_MSEC(config.automouse_layer_timeout_ms));
-    }
+    trackball_motion_changed(report_data & LED_SLCK);
     return 0;
 }
 
 static const struct hid_ops vendor_ops = {
+    .get_report = vendor_get_report_cb,
     .set_report = vendor_set_report_cb,
 };
 
@@ -0,0 +1,20 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <zephyr/device.h>
+#include <zmk/behavior.h>
+
+typedef int (*behavior_keymap_binding_callback_t)(struct zmk_behavior_binding *binding,
+                                                  struct zmk_behavior_binding_event event);
+
+struct behavior_driver_api {
+    behavior_keymap_binding_callback_t binding_pressed;
+    behavior_keymap_binding_callback_t binding_released;
+};
+
+#define BEHAVIOR_DT_INST_DEFINE DEVICE_DT_INST_DEFINE
@@ -0,0 +1,11 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#define HID_USAGE_KEY_KEYBOARD_CAPS_LOCK 0x39
+#define HID_USAGE_KEY_KEYBOARD_SCROLL_LOCK 0x47
+#define HID_USAGE_KEY_KEYPAD_NUM_LOCK_AND_CLEAR 0x53
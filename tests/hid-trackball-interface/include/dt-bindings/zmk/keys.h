@@ -0,0 +1,18 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <dt-bindings/zmk/hid_usage.h>
+#include <dt-bindings/zmk/hid_usage_pages.h>
+
+#define ZMK_HID_USAGE(page, id) (((page) << 16) | (id))
+#define ZMK_HID_USAGE_PAGE(usage) (((usage) >> 16) & 0xFF)
+#define ZMK_HID_USAGE_ID(usage) ((usage) & 0xFFFF)
+
+#define CLCK ZMK_HID_USAGE(HID_USAGE_KEY, HID_USAGE_KEY_KEYBOARD_CAPS_LOCK)
+#define SLCK ZMK_HID_USAGE(HID_USAGE_KEY, HID_USAGE_KEY_KEYBOARD_SCROLL_LOCK)
+#define KP_NLCK ZMK_HID_USAGE(HID_USAGE_KEY, HID_USAGE_KEY_KEYPAD_NUM_LOCK_AND_CLEAR)
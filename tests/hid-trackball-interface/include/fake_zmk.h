@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <zmk/activity.h>
+#include <zmk/behavior.h>
+#include <zmk/keymap.h>
+
+#define FAKE_QUEUE_LOG_SIZE 32
+
+// A binding that was put in the behavior queue, and the (virtual) time it was.
+struct fake_queued_binding {
+    struct zmk_behavior_binding binding;
+    int64_t timestamp;
+};
+
+extern struct fake_queued_binding fake_queue_log[FAKE_QUEUE_LOG_SIZE];
+extern int fake_queue_count;
+
+// While set, zmk_behavior_queue_add() fails with this error instead.
+extern int fake_queue_error;
+
+void fake_queue_reset(void);
+
+// Replaces the active layers (besides the default one) and raises a layer
+// state change, like a momentary layer key would.
+void fake_keymap_set_layers(zmk_keymap_layers_state_t state);
+
+// Positions up to and including this one are transparent on every layer, the
+// other ones have a key bound.
+#define FAKE_KEYMAP_TRANSPARENT_POSITIONS 4
+
+void fake_activity_set_state(enum zmk_activity_state state);
@@ -0,0 +1,15 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+enum zmk_activity_state {
+    ZMK_ACTIVITY_ACTIVE,
+    ZMK_ACTIVITY_IDLE,
+    ZMK_ACTIVITY_SLEEP,
+};
+
+enum zmk_activity_state zmk_activity_get_state(void);
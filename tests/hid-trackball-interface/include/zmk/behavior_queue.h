@@ -0,0 +1,15 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <zmk/behavior.h>
+
+// Recorded by the test instead of being invoked, see fake_zmk.h.
+int zmk_behavior_queue_add(uint32_t position, const struct zmk_behavior_binding behavior,
+                           bool press, uint32_t wait);
@@ -0,0 +1,19 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <zmk/activity.h>
+#include <zmk/event_manager.h>
+
+struct zmk_activity_state_changed {
+    enum zmk_activity_state state;
+};
+
+ZMK_EVENT_DECLARE(zmk_activity_state_changed);
+
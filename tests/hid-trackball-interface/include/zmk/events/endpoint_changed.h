@@ -0,0 +1,19 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <zmk/event_manager.h>
+
+struct zmk_endpoint_changed {
+    uint8_t endpoint;
+};
+
+ZMK_EVENT_DECLARE(zmk_endpoint_changed);
+
@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <zmk/event_manager.h>
+
+typedef uint8_t zmk_hid_indicators_t;
+
+struct zmk_hid_indicators_changed {
+    zmk_hid_indicators_t indicators;
+};
+
+ZMK_EVENT_DECLARE(zmk_hid_indicators_changed);
+
@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <dt-bindings/zmk/keys.h>
+#include <zmk/event_manager.h>
+
+struct zmk_keycode_state_changed {
+    uint16_t usage_page;
+    uint32_t keycode;
+    uint8_t implicit_modifiers;
+    uint8_t explicit_modifiers;
+    bool state;
+    int64_t timestamp;
+};
+
+ZMK_EVENT_DECLARE(zmk_keycode_state_changed);
+
+static inline int raise_zmk_keycode_state_changed_from_encoded(uint32_t encoded, bool pressed,
+                                                               int64_t timestamp) {
+    return raise_zmk_keycode_state_changed((struct zmk_keycode_state_changed){
+        .usage_page = ZMK_HID_USAGE_PAGE(encoded),
+        .keycode = ZMK_HID_USAGE_ID(encoded),
+        .state = pressed,
+        .timestamp = timestamp,
+    });
+}
@@ -0,0 +1,22 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <zmk/behavior.h>
+
+typedef uint32_t zmk_keymap_layers_state_t;
+typedef uint8_t zmk_keymap_layer_id_t;
+
+zmk_keymap_layer_id_t zmk_keymap_layer_default(void);
+zmk_keymap_layers_state_t zmk_keymap_layer_state(void);
+bool zmk_keymap_layer_active(zmk_keymap_layer_id_t layer);
+int zmk_keymap_layer_activate(zmk_keymap_layer_id_t layer);
+int zmk_keymap_layer_deactivate(zmk_keymap_layer_id_t layer);
+const struct zmk_behavior_binding *
+zmk_keymap_get_layer_binding_at_idx(zmk_keymap_layer_id_t layer, uint8_t binding_idx);
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zmk/event_manager.h>
+#include <zmk/behavior_queue.h>
+#include <zmk/events/activity_state_changed.h>
+#include <zmk/events/endpoint_changed.h>
+#include <zmk/events/hid_indicators_changed.h>
+#include <zmk/events/keycode_state_changed.h>
+#include <zmk/events/layer_state_changed.h>
+#include <zmk/events/position_state_changed.h>
+
+#include "fake_zmk.h"
+
+LOG_MODULE_REGISTER(zmk, CONFIG_ZMK_LOG_LEVEL);
+
+ZMK_EVENT_IMPL(zmk_activity_state_changed);
+ZMK_EVENT_IMPL(zmk_endpoint_changed);
+ZMK_EVENT_IMPL(zmk_hid_indicators_changed);
+ZMK_EVENT_IMPL(zmk_keycode_state_changed);
+ZMK_EVENT_IMPL(zmk_layer_state_changed);
+ZMK_EVENT_IMPL(zmk_position_state_changed);
+
+static int event_manager_handle_from(zmk_event_t *event, uint8_t start_index) {
+    uint8_t index = 0;
+
+    STRUCT_SECTION_FOREACH(zmk_event_subscription, sub) {
+        if (index++ < start_index || sub->event_type != event->event) {
+            continue;
+        }
+        event->last_listener_index = index - 1;
+        int ret = sub->listener->callback(event);
+        if (ret < 0) {
+            return ret;
+        }
+        if (ret == ZMK_EV_EVENT_HANDLED || ret == ZMK_EV_EVENT_CAPTURED) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+int zmk_event_manager_raise(zmk_event_t *event) { return event_manager_handle_from(event, 0); }
+
+int zmk_event_manager_release(zmk_event_t *event) {
+    return event_manager_handle_from(event, event->last_listener_index + 1);
+}
+
+struct fake_queued_binding fake_queue_log[FAKE_QUEUE_LOG_SIZE];
+int fake_queue_count;
+int fake_queue_error;
+
+void fake_queue_reset(void) { fake_queue_count = 0; }
+
+int zmk_behavior_queue_add(uint32_t position, const struct zmk_behavior_binding behavior,
+                           bool press, uint32_t wait) {
+    if (fake_queue_error) {
+        return fake_queue_error;
+    }
+    if (fake_queue_count == FAKE_QUEUE_LOG_SIZE) {
+        return -ENOMEM;
+    }
+    fake_queue_log[fake_queue_count++] = (struct fake_queued_binding){
+        .binding = behavior,
+        .timestamp = k_uptime_get(),
+    };
+    return 0;
+}
+
+const struct device *zmk_behavior_get_binding(const char *name) {
+    return device_get_binding(name);
+}
+
+static zmk_keymap_layers_state_t layer_state;
+
+zmk_keymap_layer_id_t zmk_keymap_layer_default(void) { return 0; }
+
+zmk_keymap_layers_state_t zmk_keymap_layer_state(void) { return layer_state; }
+
+bool zmk_keymap_layer_active(zmk_keymap_layer_id_t layer) { return layer_state & BIT(layer); }
+
+static int set_layer_state(zmk_keymap_layer_id_t layer, bool state) {
+    WRITE_BIT(layer_state, layer, state);
+    return raise_zmk_layer_state_changed((struct zmk_layer_state_changed){
+        .layer = layer,
+        .state = state,
+        .timestamp = k_uptime_get(),
+    });
+}
+
+int zmk_keymap_layer_activate(zmk_keymap_layer_id_t layer) { return set_layer_state(layer, true); }
+
+int zmk_keymap_layer_deactivate(zmk_keymap_layer_id_t layer) {
+    return set_layer_state(layer, false);
+}
+
+void fake_keymap_set_layers(zmk_keymap_layers_state_t state) {
+    layer_state = state;
+    raise_zmk_layer_state_changed((struct zmk_layer_state_changed){
+        .timestamp = k_uptime_get(),
+    });
+}
+
+static const struct zmk_behavior_binding key_binding = {.behavior_dev = "key_press"};
+
+const struct zmk_behavior_binding *
+zmk_keymap_get_layer_binding_at_idx(zmk_keymap_layer_id_t layer, uint8_t binding_idx) {
+    return binding_idx <= FAKE_KEYMAP_TRANSPARENT_POSITIONS ? NULL : &key_binding;
+}
+
+static enum zmk_activity_state activity_state = ZMK_ACTIVITY_ACTIVE;
+
+enum zmk_activity_state zmk_activity_get_state(void) { return activity_state; }
+
+void fake_activity_set_state(enum zmk_activity_state state) {
+    activity_state = state;
+    raise_zmk_activity_state_changed((struct zmk_activity_state_changed){.state = state});
+}
@@ -0,0 +1,580 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+#include <drivers/behavior.h>
+#include <dt-bindings/zmk/hid-trackball.h>
+#include <zmk/hid_trackball.h>
+#include <zmk/events/endpoint_changed.h>
+#include <zmk/events/hid_indicators_changed.h>
+#include <zmk/events/keycode_state_changed.h>
+#include <zmk/events/position_state_changed.h>
+
+#include "fake_zmk.h"
+
+#define LED_NLCK 0x01
+#define LED_CLCK 0x02
+#define LED_SLCK 0x04
+
+// Same as boards/native_sim.overlay.
+#define SCROLL_LAYER 1
+#define SNIPE_LAYER 2
+#define AUTOMOUSE_LAYER 3
+#define AUTOMOUSE_TIMEOUT_MS 400
+#define TUNED_SCROLL_LAYER 5
+#define TUNED_AUTOMOUSE_LAYER 6
+#define TUNED_LAYER_SETTLE_MS 20
+#define TB_CMD_TAP_MS 5
+#define TB_CMD_WAIT_MS 5
+#define TBS_SPEC_TAPPING_TERM_MS 200
+
+// The adaptive timeout of the tuned trackball is learned in steps of its
+// automouse-timeout-max-ms over the 16 buckets of the module.
+#define TUNED_TIMEOUT_MAX_MS 1200
+#define TUNED_GAP_BUCKET_MS 75
+
+// Same as hid-trackball-interface.c.
+#define COMMAND_TIMEOUT_MS 500
+#define COMMAND_MAX_ATTEMPTS 3
+#define COMMAND_SEND_RETRY_MS 50
+#define ACK_PULSE_UNIT_MS 15
+#define ACK_PULSE_MAX_MS (ACK_PULSE_UNIT_MS * 4)
+#define AUTOMOUSE_WAKE_FALLBACK_MS 50
+#define PROBE_DELAY_MS 500
+
+// The simulated host echoes every lock key after this time, and the bits of a
+// frame take this long between its two markers.
+#define HOST_ECHO_MS 8
+#define FRAME_BITS_MS 40
+
+// Long enough for every timer of the module to run out.
+#define SETTLE_MS 1000
+
+// Timeouts expire a tick late at most, and polling them adds another tick.
+#define TIMER_SLACK_MS 2
+
+enum mode {
+    MOVE,
+    SCROLL,
+    SNIPE,
+};
+
+static const char *const mode_names[] = {"MOVE", "SCROLL", "SNIPE"};
+
+static const char *const mode_bindings[] = {
+    [MOVE] = DEVICE_DT_NAME(DT_NODELABEL(test_set_move)),
+    [SCROLL] = DEVICE_DT_NAME(DT_NODELABEL(test_set_scroll)),
+    [SNIPE] = DEVICE_DT_NAME(DT_NODELABEL(test_set_snipe)),
+};
+
+static const zmk_keymap_layers_state_t mode_layers[] = {
+    [MOVE] = 0,
+    [SCROLL] = BIT(SCROLL_LAYER),
+    [SNIPE] = BIT(SNIPE_LAYER),
+};
+
+static uint8_t host_leds;
+static int delivered;
+
+// The lock keys the keyboard tapped. While host_echoes is set, the simulated
+// host echoes each press by itself, HOST_ECHO_MS later, instead of the test
+// doing it.
+#define KEY_LOG_SIZE 64
+
+struct key_event {
+    uint32_t keycode;
+    bool pressed;
+    bool echo;
+    int64_t timestamp;
+};
+
+static struct key_event key_log[KEY_LOG_SIZE];
+static int key_log_count;
+static int key_log_echoed;
+static bool host_echoes;
+
+static void reset_queue(void) {
+    fake_queue_reset();
+    delivered = 0;
+}
+
+static int queued_mode(int index) {
+    for (int mode = MOVE; mode <= SNIPE; mode++) {
+        if (strcmp(fake_queue_log[index].binding.behavior_dev, mode_bindings[mode]) == 0) {
+            return mode;
+        }
+    }
+    return -1;
+}
+
+static void host_set_leds(uint8_t leds) {
+    host_leds = leds;
+    raise_zmk_hid_indicators_changed((struct zmk_hid_indicators_changed){.indicators = host_leds});
+}
+
+static void host_set_slck(bool on) {
+    host_set_leds(on ? host_leds | LED_SLCK : host_leds & ~LED_SLCK);
+}
+
+static uint8_t lock_key_led(uint32_t keycode) {
+    switch (keycode) {
+    case KP_NLCK:
+        return LED_NLCK;
+    case CLCK:
+        return LED_CLCK;
+    case SLCK:
+        return LED_SLCK;
+    default:
+        return 0;
+    }
+}
+
+static void host_echo_work(struct k_work *item);
+static K_WORK_DELAYABLE_DEFINE(host_echo_delayed, host_echo_work);
+
+static void host_echo_work(struct k_work *item) {
+    for (; key_log_echoed < key_log_count; key_log_echoed++) {
+        const struct key_event *key = &key_log[key_log_echoed];
+        if (!key->echo) {
+            continue;
+        }
+        int64_t wait_ms = key->timestamp + HOST_ECHO_MS - k_uptime_get();
+        if (wait_ms > 0) {
+            k_work_schedule(&host_echo_delayed, K_MSEC(wait_ms));
+            return;
+        }
+        host_set_leds(host_leds ^ lock_key_led(key->keycode));
+    }
+}
+
+static int key_log_listener_cb(const zmk_event_t *eh) {
+    struct zmk_keycode_state_changed *ev = as_zmk_keycode_state_changed(eh);
+    uint32_t keycode = ZMK_HID_USAGE(ev->usage_page, ev->keycode);
+    if (!lock_key_led(keycode) || key_log_count == KEY_LOG_SIZE) {
+        return 0;
+    }
+    key_log[key_log_count++] = (struct key_event){
+        .keycode = keycode,
+        .pressed = ev->state,
+        .echo = host_echoes && ev->state,
+        .timestamp = ev->timestamp,
+    };
+    if (host_echoes && ev->state) {
+        k_work_schedule(&host_echo_delayed, K_MSEC(HOST_ECHO_MS));
+    }
+    return 0;
+}
+
+ZMK_LISTENER(test_key_log, key_log_listener_cb);
+ZMK_SUBSCRIPTION(test_key_log, zmk_keycode_state_changed);
+
+static int key_presses(uint32_t keycode) {
+    int presses = 0;
+    for (int i = 0; i < key_log_count; i++) {
+        if (key_log[i].keycode == keycode && key_log[i].pressed) {
+            presses++;
+        }
+    }
+    return presses;
+}
+
+// Frames tapped by &tb_cmd, which opens and closes each with a marker.
+static int frames_sent(void) { return key_presses(SLCK) / 2; }
+
+// A frame marker as the command macro taps it, echoed by the host.
+static void tap_marker(void) {
+    raise_zmk_keycode_state_changed_from_encoded(SLCK, true, k_uptime_get());
+    raise_zmk_keycode_state_changed_from_encoded(SLCK, false, k_uptime_get());
+    k_sleep(K_MSEC(HOST_ECHO_MS));
+    host_set_slck(!(host_leds & LED_SLCK));
+}
+
+static void play_frame(void) {
+    tap_marker();
+    k_sleep(K_MSEC(FRAME_BITS_MS));
+    tap_marker();
+}
+
+// The trackball's answer to the closing marker, a pulse of width_ms.
+static void ack_pulse(int width_ms) {
+    k_sleep(K_MSEC(HOST_ECHO_MS));
+    host_set_slck(!(host_leds & LED_SLCK));
+    k_sleep(K_MSEC(width_ms));
+    host_set_slck(!(host_leds & LED_SLCK));
+}
+
+// Plays the command in flight, which is always the last one queued, to the
+// trackball, which acknowledges it. Repeats for the commands queued in turn.
+static void deliver_pending(void) {
+    while (delivered < fake_queue_count) {
+        delivered = fake_queue_count;
+        int mode = queued_mode(delivered - 1);
+        play_frame();
+        ack_pulse((mode + 1) * ACK_PULSE_UNIT_MS);
+    }
+}
+
+static void enter_mode(enum mode mode) {
+    fake_keymap_set_layers(mode_layers[mode]);
+    deliver_pending();
+    k_sleep(K_MSEC(SETTLE_MS));
+    reset_queue();
+}
+
+// Waits for a layer to reach the given state, and returns how long it took or
+// -1 if it didn't within max_ms.
+static int wait_for_layer(zmk_keymap_layer_id_t layer, bool active, int max_ms) {
+    int64_t start = k_uptime_get();
+    while (zmk_keymap_layer_active(layer) != active) {
+        if (k_uptime_get() - start >= max_ms) {
+            return -1;
+        }
+        k_sleep(K_MSEC(1));
+    }
+    return k_uptime_get() - start;
+}
+
+static int wait_for_automouse(bool active, int max_ms) {
+    return wait_for_layer(AUTOMOUSE_LAYER, active, max_ms);
+}
+
+// Waits for &tb_cmd to finish its commands, and returns the time it did or -1
+// if it didn't within max_ms.
+static int64_t wait_for_emitter(int max_ms) {
+    int64_t start = k_uptime_get();
+    while (!zmk_hid_trackball_command_idle()) {
+        if (k_uptime_get() - start >= max_ms) {
+            return -1;
+        }
+        k_sleep(K_MSEC(1));
+    }
+    return k_uptime_get();
+}
+
+static void press_position(uint32_t position) {
+    raise_zmk_position_state_changed((struct zmk_position_state_changed){
+        .position = position,
+        .state = true,
+        .timestamp = k_uptime_get(),
+    });
+}
+
+static void tap_tbs_spec(uint32_t position, bool pressed) {
+    struct zmk_behavior_binding binding = {
+        .behavior_dev = DEVICE_DT_NAME(DT_NODELABEL(tbs_spec)),
+    };
+    struct zmk_behavior_binding_event event = {
+        .position = position,
+        .timestamp = k_uptime_get(),
+    };
+    const struct behavior_driver_api *api = zmk_behavior_get_binding(binding.behavior_dev)->api;
+    if (pressed) {
+        api->binding_pressed(&binding, event);
+    } else {
+        api->binding_released(&binding, event);
+    }
+}
+
+static void before_each(void *fixture) {
+    fake_activity_set_state(ZMK_ACTIVITY_ACTIVE);
+    fake_queue_error = 0;
+    host_echoes = false;
+    k_work_cancel_delayable(&host_echo_delayed);
+    host_set_slck(false);
+    enter_mode(MOVE);
+    key_log_count = 0;
+    key_log_echoed = 0;
+}
+
+ZTEST_SUITE(hid_trackball_interface, NULL, NULL, before_each, NULL, NULL);
+
+ZTEST(hid_trackball_interface, test_mode_transition_matrix) {
+    for (int from = MOVE; from <= SNIPE; from++) {
+        for (int to = MOVE; to <= SNIPE; to++) {
+            enter_mode(from);
+            int64_t start = k_uptime_get();
+            fake_keymap_set_layers(mode_layers[to]);
+            if (from == to) {
+                zassert_equal(fake_queue_count, 0, "%s -> %s sent a command", mode_names[from],
+                              mode_names[to]);
+                continue;
+            }
+
+            zassert_equal(fake_queue_count, 1, "%s -> %s sent %d commands", mode_names[from],
+                          mode_names[to], fake_queue_count);
+            zassert_equal(queued_mode(0), to, "%s -> %s sent %s", mode_names[from],
+                          mode_names[to], mode_names[queued_mode(0)]);
+            int latency = fake_queue_log[0].timestamp - start;
+            deliver_pending();
+            int round_trip = k_uptime_get() - start;
+            k_sleep(K_MSEC(COMMAND_TIMEOUT_MS));
+            zassert_equal(fake_queue_count, 1, "%s -> %s was sent again", mode_names[from],
+                          mode_names[to]);
+            zassert_equal(latency, 0, "%s -> %s queued after %d ms", mode_names[from],
+                          mode_names[to], latency);
+            TC_PRINT("%-6s -> %-6s queued after %d ms, acknowledged after %d ms\n",
+                     mode_names[from], mode_names[to], latency, round_trip);
+        }
+    }
+}
+
+ZTEST(hid_trackball_interface, test_scroll_wins_over_snipe) {
+    fake_keymap_set_layers(BIT(SCROLL_LAYER) | BIT(SNIPE_LAYER));
+    zassert_equal(fake_queue_count, 1);
+    zassert_equal(queued_mode(0), SCROLL);
+    deliver_pending();
+}
+
+ZTEST(hid_trackball_interface, test_superseded_transitions_are_skipped) {
+    int64_t start = k_uptime_get();
+    fake_keymap_set_layers(mode_layers[SCROLL]);
+    fake_keymap_set_layers(mode_layers[SNIPE]);
+    fake_keymap_set_layers(mode_layers[MOVE]);
+    fake_keymap_set_layers(mode_layers[SNIPE]);
+    zassert_equal(fake_queue_count, 1, "a second command was sent while one was in flight");
+    zassert_equal(queued_mode(0), SCROLL);
+
+    deliver_pending();
+    zassert_equal(fake_queue_count, 2);
+    zassert_equal(queued_mode(1), SNIPE, "converged on %s", mode_names[queued_mode(1)]);
+    TC_PRINT("latest mode queued after %d ms behind a command in flight\n",
+             (int)(fake_queue_log[1].timestamp - start));
+}
+
+ZTEST(hid_trackball_interface, test_lost_command_is_retransmitted) {
+    fake_keymap_set_layers(mode_layers[SCROLL]);
+    k_sleep(K_MSEC(COMMAND_TIMEOUT_MS * COMMAND_MAX_ATTEMPTS + 10));
+    zassert_equal(fake_queue_count, COMMAND_MAX_ATTEMPTS);
+    for (int i = 1; i < fake_queue_count; i++) {
+        zassert_equal(queued_mode(i), SCROLL);
+        zassert_within(fake_queue_log[i].timestamp - fake_queue_log[i - 1].timestamp,
+                       COMMAND_TIMEOUT_MS, TIMER_SLACK_MS);
+    }
+}
+
+ZTEST(hid_trackball_interface, test_wrong_acknowledgement_is_retransmitted) {
+    fake_keymap_set_layers(mode_layers[SNIPE]);
+    play_frame();
+    ack_pulse((SCROLL + 1) * ACK_PULSE_UNIT_MS);
+    zassert_equal(fake_queue_count, 2, "an acknowledgement of the wrong mode was accepted");
+    zassert_equal(queued_mode(1), SNIPE);
+    deliver_pending();
+    zassert_false(zmk_keymap_layer_active(AUTOMOUSE_LAYER));
+}
+
+ZTEST(hid_trackball_interface, test_motion_in_acknowledgement_window) {
+    fake_keymap_set_layers(mode_layers[SCROLL]);
+    play_frame();
+    // A pulse that doesn't end in time is the trackball moving.
+    k_sleep(K_MSEC(HOST_ECHO_MS));
+    host_set_slck(!(host_leds & LED_SLCK));
+    k_sleep(K_MSEC(ACK_PULSE_MAX_MS + 1));
+    zassert_true(zmk_keymap_layer_active(AUTOMOUSE_LAYER));
+    zassert_equal(fake_queue_count, 2, "the command wasn't sent again");
+    host_set_slck(false);
+}
+
+ZTEST(hid_trackball_interface, test_automouse_timeout) {
+    host_set_slck(true);
+    zassert_true(zmk_keymap_layer_active(AUTOMOUSE_LAYER));
+    host_set_slck(false);
+    int latency = wait_for_automouse(false, SETTLE_MS);
+    zassert_within(latency, AUTOMOUSE_TIMEOUT_MS, TIMER_SLACK_MS, "deactivated after %d ms",
+                   latency);
+    TC_PRINT("automouse layer deactivated %d ms after the motion stopped\n", latency);
+    zassert_equal(fake_queue_count, 0, "the automouse layer changed the mode");
+}
+
+ZTEST(hid_trackball_interface, test_automouse_stays_on_when_motion_resumes) {
+    host_set_slck(true);
+    host_set_slck(false);
+    k_sleep(K_MSEC(AUTOMOUSE_TIMEOUT_MS / 2));
+    host_set_slck(true);
+    k_sleep(K_MSEC(AUTOMOUSE_TIMEOUT_MS * 2));
+    zassert_true(zmk_keymap_layer_active(AUTOMOUSE_LAYER));
+    host_set_slck(false);
+    zassert_within(wait_for_automouse(false, SETTLE_MS), AUTOMOUSE_TIMEOUT_MS, TIMER_SLACK_MS);
+}
+
+ZTEST(hid_trackball_interface, test_automouse_wake_fallback) {
+    fake_activity_set_state(ZMK_ACTIVITY_IDLE);
+    host_set_slck(true);
+    zassert_false(zmk_keymap_layer_active(AUTOMOUSE_LAYER), "activated while idle");
+    int latency = wait_for_automouse(true, SETTLE_MS);
+    zassert_within(latency, AUTOMOUSE_WAKE_FALLBACK_MS, TIMER_SLACK_MS, "activated after %d ms",
+                   latency);
+    TC_PRINT("automouse layer activated %d ms after motion while idle\n", latency);
+}
+
+ZTEST(hid_trackball_interface, test_automouse_wake_on_activity) {
+    fake_activity_set_state(ZMK_ACTIVITY_IDLE);
+    host_set_slck(true);
+    k_sleep(K_MSEC(10));
+    zassert_false(zmk_keymap_layer_active(AUTOMOUSE_LAYER));
+    fake_activity_set_state(ZMK_ACTIVITY_ACTIVE);
+    int latency = wait_for_automouse(true, AUTOMOUSE_WAKE_FALLBACK_MS);
+    zassert_true(latency >= 0 && latency <= TIMER_SLACK_MS, "activated %d ms after waking",
+                 latency);
+}
+
+ZTEST(hid_trackball_interface, test_automouse_exit_on_typing) {
+    host_set_slck(true);
+    host_set_slck(false);
+    press_position(FAKE_KEYMAP_TRANSPARENT_POSITIONS + 1);
+    zassert_true(zmk_keymap_layer_active(AUTOMOUSE_LAYER), "a mouse key turned the layer off");
+    press_position(FAKE_KEYMAP_TRANSPARENT_POSITIONS);
+    zassert_false(zmk_keymap_layer_active(AUTOMOUSE_LAYER), "typing left the layer on");
+}
+
+ZTEST(hid_trackball_interface, test_unqueued_command_is_retried) {
+    fake_queue_error = -ENOMEM;
+    fake_keymap_set_layers(mode_layers[SCROLL]);
+    k_sleep(K_MSEC(COMMAND_TIMEOUT_MS * COMMAND_MAX_ATTEMPTS));
+    zassert_equal(fake_queue_count, 0);
+
+    // A command that never made it into the queue isn't a lost one, so it
+    // isn't given up after COMMAND_MAX_ATTEMPTS.
+    fake_queue_error = 0;
+    k_sleep(K_MSEC(COMMAND_SEND_RETRY_MS + TIMER_SLACK_MS));
+    zassert_equal(fake_queue_count, 1, "the command wasn't tried again");
+    zassert_equal(queued_mode(0), SCROLL);
+    deliver_pending();
+}
+
+ZTEST(hid_trackball_interface, test_layer_settle_skips_transient_layers) {
+    fake_keymap_set_layers(BIT(TUNED_SCROLL_LAYER));
+    k_sleep(K_MSEC(TUNED_LAYER_SETTLE_MS / 2));
+    fake_keymap_set_layers(0);
+    k_sleep(K_MSEC(TUNED_LAYER_SETTLE_MS + TIMER_SLACK_MS));
+    zassert_equal(fake_queue_count, 0, "a layer only passed through was sent");
+
+    int64_t start = k_uptime_get();
+    fake_keymap_set_layers(BIT(TUNED_SCROLL_LAYER));
+    zassert_equal(fake_queue_count, 0, "sent before the layers settled");
+    k_sleep(K_MSEC(TUNED_LAYER_SETTLE_MS + TIMER_SLACK_MS));
+    zassert_equal(fake_queue_count, 1);
+    zassert_equal(queued_mode(0), SCROLL);
+    int latency = fake_queue_log[0].timestamp - start;
+    zassert_within(latency, TUNED_LAYER_SETTLE_MS, TIMER_SLACK_MS, "queued after %d ms", latency);
+    deliver_pending();
+
+    fake_keymap_set_layers(0);
+    k_sleep(K_MSEC(TUNED_LAYER_SETTLE_MS + TIMER_SLACK_MS));
+    deliver_pending();
+}
+
+// The tuned trackball learns the pauses after which the mouse moves again.
+// The other tests leave some pauses of their own behind, so it is trained on
+// many more, and then on enough long ones to outweigh them.
+#define TRAINING_PAUSES 30
+#define TRAINING_PAUSE_MS 600
+#define LONG_PAUSES 15
+#define LONG_PAUSE_MS 2000
+
+static void pause_motion(int pauses, int pause_ms) {
+    for (int i = 0; i < pauses; i++) {
+        host_set_slck(true);
+        host_set_slck(false);
+        k_sleep(K_MSEC(pause_ms));
+    }
+}
+
+ZTEST(hid_trackball_interface, test_automouse_adaptive_timeout) {
+    pause_motion(TRAINING_PAUSES, TRAINING_PAUSE_MS);
+    host_set_slck(true);
+    host_set_slck(false);
+    int expected = (TRAINING_PAUSE_MS / TUNED_GAP_BUCKET_MS + 1) * TUNED_GAP_BUCKET_MS;
+    int latency = wait_for_layer(TUNED_AUTOMOUSE_LAYER, false, TUNED_TIMEOUT_MAX_MS * 2);
+    zassert_within(latency, expected, TIMER_SLACK_MS, "deactivated after %d ms", latency);
+
+    // Pauses past the longest timeout count as that long.
+    pause_motion(LONG_PAUSES, LONG_PAUSE_MS);
+    host_set_slck(true);
+    host_set_slck(false);
+    latency = wait_for_layer(TUNED_AUTOMOUSE_LAYER, false, TUNED_TIMEOUT_MAX_MS * 2);
+    zassert_within(latency, TUNED_TIMEOUT_MAX_MS, TIMER_SLACK_MS, "deactivated after %d ms",
+                   latency);
+}
+
+ZTEST(hid_trackball_interface, test_link_probe_holds_back_commands) {
+    host_echoes = true;
+    raise_zmk_endpoint_changed((struct zmk_endpoint_changed){0});
+    k_sleep(K_MSEC(PROBE_DELAY_MS + TIMER_SLACK_MS));
+    zassert_equal(key_presses(KP_NLCK), 1, "the probe didn't start");
+
+    // The command waits for the echo of the probe tap in flight.
+    fake_keymap_set_layers(mode_layers[SCROLL]);
+    zassert_equal(fake_queue_count, 0, "a command was sent during a probe tap");
+    k_sleep(K_MSEC(HOST_ECHO_MS + TIMER_SLACK_MS));
+    zassert_equal(fake_queue_count, 1, "the command wasn't sent after the echo");
+    int latency = fake_queue_log[0].timestamp - key_log[0].timestamp;
+    zassert_within(latency, HOST_ECHO_MS, TIMER_SLACK_MS, "queued %d ms after the probe tap",
+                   latency);
+
+    host_echoes = false;
+    deliver_pending();
+    host_echoes = true;
+    for (int i = 0; i < 3 * SETTLE_MS && zmk_hid_trackball_usable_leds() == 0; i++) {
+        k_sleep(K_MSEC(1));
+    }
+    zassert_equal(zmk_hid_trackball_usable_leds(), LED_NLCK | LED_CLCK);
+    zassert_within(zmk_hid_trackball_echo_ms(), HOST_ECHO_MS, TIMER_SLACK_MS);
+    zassert_equal(key_presses(KP_NLCK), 2);
+    zassert_equal(key_presses(CLCK), 2);
+}
+
+ZTEST(hid_trackball_interface, test_tb_cmd_waits_out_the_last_delay) {
+    const struct device *tb_cmd = DEVICE_DT_GET(DT_NODELABEL(tb_cmd));
+    // Two taps per bit between the markers, and just the markers for a frame
+    // without bits.
+    static const uint32_t taps[] = {SLCK, KP_NLCK, KP_NLCK, KP_NLCK, KP_NLCK, SLCK, SLCK, SLCK};
+    int wait_ms = MAX(TB_CMD_WAIT_MS, zmk_hid_trackball_echo_ms());
+
+    host_echoes = true;
+    zassert_ok(zmk_hid_trackball_command_send(tb_cmd, TB_CMD_SET_SCROLL));
+    zassert_ok(zmk_hid_trackball_command_send(tb_cmd, TB_CMD_SET_MOVE));
+    zassert_false(zmk_hid_trackball_command_idle());
+    int64_t idle_timestamp = wait_for_emitter(SETTLE_MS);
+    zassert_true(idle_timestamp >= 0, "still busy");
+
+    zassert_equal(key_log_count, 2 * ARRAY_SIZE(taps));
+    for (int i = 0; i < key_log_count; i++) {
+        zassert_equal(key_log[i].keycode, taps[i / 2], "wrong key %d", i);
+        zassert_equal(key_log[i].pressed, i % 2 == 0, "wrong state of key %d", i);
+        if (i > 0) {
+            int gap = key_log[i].timestamp - key_log[i - 1].timestamp;
+            zassert_within(gap, key_log[i].pressed ? wait_ms : TB_CMD_TAP_MS, TIMER_SLACK_MS,
+                           "key %d after %d ms", i, gap);
+        }
+    }
+    int idle_gap = idle_timestamp - key_log[key_log_count - 1].timestamp;
+    zassert_true(idle_gap >= wait_ms, "idle %d ms after the last release", idle_gap);
+}
+
+ZTEST(hid_trackball_interface, test_tbs_spec_toggles_back_after_holds) {
+    uint32_t position = FAKE_KEYMAP_TRANSPARENT_POSITIONS + 1;
+    host_echoes = true;
+
+    tap_tbs_spec(position, true);
+    k_sleep(K_MSEC(TBS_SPEC_TAPPING_TERM_MS / 2));
+    tap_tbs_spec(position, false);
+    zassert_true(wait_for_emitter(SETTLE_MS) >= 0);
+    zassert_equal(frames_sent(), 1, "a tap didn't keep scroll-mode toggled");
+
+    tap_tbs_spec(position, true);
+    k_sleep(K_MSEC(TBS_SPEC_TAPPING_TERM_MS));
+    tap_tbs_spec(position, false);
+    zassert_true(wait_for_emitter(SETTLE_MS) >= 0);
+    zassert_equal(frames_sent(), 3, "a hold didn't toggle back");
+
+    tap_tbs_spec(position, true);
+    press_position(position + 1);
+    tap_tbs_spec(position, false);
+    zassert_true(wait_for_emitter(SETTLE_MS) >= 0);
+    zassert_equal(frames_sent(), 5, "an interrupted tap didn't toggle back");
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+// Creates a uhid device with the vendor interface of the keyboard
+// (CONFIG_ZMK_HID_TRACKBALL_INTERFACE_FEATURE_CHANNEL) and logs the feature
+// reports it receives, so hid-trackball-relay can be tried without a keyboard.
+//
+//   cc -O2 -o fake-keyboard fake-keyboard.c
+//   fake-keyboard
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/uhid.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define VENDOR_REPORT_ID_MOTION 0x01
+#define VENDOR_REPORT_ID_STATE 0x02
+#define VENDOR_STATE_VERSION 4
+#define VENDOR_STATE_LEN 17
+#define LED_SLCK 0x04
+
+// Same as vendor_hid_report_desc in hid-trackball-interface.c.
+static const uint8_t vendor_hid_report_desc[] = {
+    0x06, 0x00, 0xFF, // Usage Page (Vendor Defined 0xFF00)
+    0x09, 0x01,       // Usage (Vendor Usage 1)
+    0xA1, 0x01,       // Collection (Application)
+    0x85, 0x01,       //   Report ID (1)
+    0x15, 0x00,       //   Logical Minimum (0)
+    0x26, 0xFF, 0x00, //   Logical Maximum (255)
+    0x75, 0x08,       //   Report Size (8)
+    0x95, 0x01,       //   Report Count (1)
+    0xB1, 0x02,       //   Feature (Data, Variable, Absolute)
+    0x85, 0x02,       //   Report ID (2)
+    0x09, 0x02,       //   Usage (Vendor Usage 2)
+    0x95, 0x11,       //   Report Count (17)
+    0xB1, 0x02,       //   Feature (Data, Variable, Absolute)
+    0xC0,             // End Collection
+};
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int send_event(int fd, const struct uhid_event *ev) {
+    if (write(fd, ev, sizeof(*ev)) != sizeof(*ev)) {
+        perror("write");
+        return -1;
+    }
+    return 0;
+}
+
+// Logs a motion report like the keyboard would act on it. Returns an errno for
+// reports the keyboard rejects.
+static int handle_set_report(const struct uhid_set_report_req *req, bool *moving) {
+    printf("%lld: set feature report %u:", (long long)now_ms(), req->rnum);
+    for (int i = 0; i < req->size; i++) {
+        printf(" %02x", req->data[i]);
+    }
+    if (req->rtype != UHID_FEATURE_REPORT) {
+        printf(" (not a feature report)\n");
+        return EINVAL;
+    }
+    if (req->size < 2 || req->data[0] != VENDOR_REPORT_ID_MOTION) {
+        printf(" (rejected)\n");
+        return req->size < 2 ? EINVAL : EOPNOTSUPP;
+    }
+    bool slck = req->data[1] & LED_SLCK;
+    printf(" -> motion %s%s\n", slck ? "on" : "off", slck == *moving ? " (unchanged)" : "");
+    *moving = slck;
+    return 0;
+}
+
+int main(void) {
+    int fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "/dev/uhid: %s\n", strerror(errno));
+        return 1;
+    }
+
+    struct uhid_event ev = {.type = UHID_CREATE2};
+    snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name),
+             "hid-trackball-relay fake keyboard");
+    memcpy(ev.u.create2.rd_data, vendor_hid_report_desc, sizeof(vendor_hid_report_desc));
+    ev.u.create2.rd_size = sizeof(vendor_hid_report_desc);
+    ev.u.create2.bus = BUS_VIRTUAL;
+    ev.u.create2.vendor = 0x1d50;
+    ev.u.create2.product = 0x615e;
+    if (send_event(fd, &ev) < 0) {
+        return 1;
+    }
+    printf("created, find its hidraw node with: grep -l 'fake keyboard' "
+           "/sys/class/hidraw/*/device/uevent\n");
+    fflush(stdout);
+
+    bool moving = false;
+    for (;;) {
+        memset(&ev, 0, sizeof(ev));
+        ssize_t len = read(fd, &ev, sizeof(ev));
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            return 1;
+        }
+
+        struct uhid_event reply = {0};
+        switch (ev.type) {
+        case UHID_SET_REPORT:
+            reply.type = UHID_SET_REPORT_REPLY;
+            reply.u.set_report_reply.id = ev.u.set_report.id;
+            reply.u.set_report_reply.err = handle_set_report(&ev.u.set_report, &moving);
+            fflush(stdout);
+            if (send_event(fd, &reply) < 0) {
+                return 1;
+            }
+            break;
+        case UHID_GET_REPORT:
+            // Answer the state report with its version, and the automouse flag
+            // following the motion reports.
+            reply.type = UHID_GET_REPORT_REPLY;
+            reply.u.get_report_reply.id = ev.u.get_report.id;
+            if (ev.u.get_report.rnum != VENDOR_REPORT_ID_STATE) {
+                reply.u.get_report_reply.err = EOPNOTSUPP;
+            } else {
+                reply.u.get_report_reply.size = 1 + VENDOR_STATE_LEN;
+                reply.u.get_report_reply.data[0] = VENDOR_REPORT_ID_STATE;
+                reply.u.get_report_reply.data[1] = VENDOR_STATE_VERSION;
+                reply.u.get_report_reply.data[4] = moving;
+            }
+            if (send_event(fd, &reply) < 0) {
+                return 1;
+            }
+            break;
+        case UHID_OPEN:
+            printf("%lld: opened\n", (long long)now_ms());
+            fflush(stdout);
+            break;
+        case UHID_CLOSE:
+            printf("%lld: closed\n", (long long)now_ms());
+            fflush(stdout);
+            break;
+        default:
+            break;
+        }
+    }
+}
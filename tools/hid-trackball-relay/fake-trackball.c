@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+// Creates a uinput mouse that moves in bursts with pauses in between, as a
+// motion source for hid-trackball-relay without a trackball.
+//
+//   cc -O2 -o fake-trackball fake-trackball.c
+//   fake-trackball -m 300 -p 500 -c 10
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/uinput.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REPORT_INTERVAL_MS 8
+
+static int move_ms = 300;
+static int pause_ms = 500;
+static int bursts = 10;
+
+static void sleep_ms(int ms) {
+    struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+static int emit(int fd, int type, int code, int value) {
+    struct input_event ev = {.type = type, .code = code, .value = value};
+    if (write(fd, &ev, sizeof(ev)) != sizeof(ev)) {
+        perror("write");
+        return -1;
+    }
+    return 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-m move_ms] [-p pause_ms] [-c bursts]\n"
+            "  -m  move for move_ms per burst (default %d)\n"
+            "  -p  pause for pause_ms between bursts (default %d)\n"
+            "  -c  number of bursts, 0 to repeat forever (default %d)\n",
+            name, move_ms, pause_ms, bursts);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "m:p:c:")) != -1) {
+        switch (opt) {
+        case 'm':
+            move_ms = atoi(optarg);
+            break;
+        case 'p':
+            pause_ms = atoi(optarg);
+            break;
+        case 'c':
+            bursts = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (move_ms <= 0 || pause_ms < 0 || bursts < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+    if (fd < 0) {
+        fprintf(stderr, "/dev/uinput: %s\n", strerror(errno));
+        return 1;
+    }
+    ioctl(fd, UI_SET_EVBIT, EV_KEY);
+    ioctl(fd, UI_SET_KEYBIT, BTN_LEFT);
+    ioctl(fd, UI_SET_EVBIT, EV_REL);
+    ioctl(fd, UI_SET_RELBIT, REL_X);
+    ioctl(fd, UI_SET_RELBIT, REL_Y);
+
+    struct uinput_setup setup = {
+        .id = {.bustype = BUS_VIRTUAL, .vendor = 0x1d50, .product = 0x0001},
+        .name = "hid-trackball-relay fake trackball",
+    };
+    if (ioctl(fd, UI_DEV_SETUP, &setup) < 0 || ioctl(fd, UI_DEV_CREATE) < 0) {
+        perror("uinput");
+        return 1;
+    }
+    char sysname[64];
+    if (ioctl(fd, UI_GET_SYSNAME(sizeof(sysname)), sysname) >= 0) {
+        printf("created /sys/devices/virtual/input/%s, pass its event node to the relay\n",
+               sysname);
+        fflush(stdout);
+    }
+    // Give udev and the relay time to open the new device.
+    sleep(1);
+
+    for (int burst = 0; bursts == 0 || burst < bursts; burst++) {
+        printf("burst %d\n", burst);
+        fflush(stdout);
+        for (int t = 0; t < move_ms; t += REPORT_INTERVAL_MS) {
+            if (emit(fd, EV_REL, REL_X, 3) < 0 || emit(fd, EV_REL, REL_Y, -2) < 0 ||
+                emit(fd, EV_SYN, SYN_REPORT, 0) < 0) {
+                return 1;
+            }
+            sleep_ms(REPORT_INTERVAL_MS);
+        }
+        sleep_ms(pause_ms);
+    }
+
+    ioctl(fd, UI_DEV_DESTROY);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+// Relays the motion of a trackball to the vendor feature channel of the
+// keyboard (CONFIG_ZMK_HID_TRACKBALL_INTERFACE_FEATURE_CHANNEL), so the
+// automouse layer works without the Scroll Lock round trip through the host.
+//
+//   cc -O2 -o hid-trackball-relay hid-trackball-relay.c
+//   hid-trackball-relay /dev/input/by-id/...-event-mouse /dev/hidrawN
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/hidraw.h>
+#include <linux/input.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define VENDOR_REPORT_ID_MOTION 0x01
+#define LED_SLCK 0x04
+
+// Motion stops being reported after this long without movement, like the
+// Scroll Lock timeout of the trackball firmware.
+#define DEFAULT_IDLE_MS 200
+// Reports are sent at most this often, changes in between are batched.
+#define DEFAULT_MIN_INTERVAL_MS 20
+
+static int idle_ms = DEFAULT_IDLE_MS;
+static int min_interval_ms = DEFAULT_MIN_INTERVAL_MS;
+static bool dry_run = false;
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int send_motion_report(int hidraw_fd, bool moving) {
+    uint8_t report[2] = {VENDOR_REPORT_ID_MOTION, moving ? LED_SLCK : 0};
+
+    if (dry_run) {
+        printf("%lld: motion %s\n", (long long)now_ms(), moving ? "on" : "off");
+        fflush(stdout);
+        return 0;
+    }
+    if (ioctl(hidraw_fd, HIDIOCSFEATURE(sizeof(report)), report) < 0) {
+        perror("HIDIOCSFEATURE");
+        return -1;
+    }
+    return 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-i idle_ms] [-r min_interval_ms] [-n] <evdev> [hidraw]\n"
+            "  -i  report the motion as stopped after idle_ms (default %d)\n"
+            "  -r  send at most one report every min_interval_ms (default %d)\n"
+            "  -n  print the reports instead of sending them\n",
+            name, DEFAULT_IDLE_MS, DEFAULT_MIN_INTERVAL_MS);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "i:r:n")) != -1) {
+        switch (opt) {
+        case 'i':
+            idle_ms = atoi(optarg);
+            break;
+        case 'r':
+            min_interval_ms = atoi(optarg);
+            break;
+        case 'n':
+            dry_run = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind + (dry_run ? 1 : 2) > argc || idle_ms <= 0 || min_interval_ms < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    int evdev_fd = open(argv[optind], O_RDONLY);
+    if (evdev_fd < 0) {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    int hidraw_fd = -1;
+    if (!dry_run) {
+        hidraw_fd = open(argv[optind + 1], O_RDWR);
+        if (hidraw_fd < 0) {
+            fprintf(stderr, "%s: %s\n", argv[optind + 1], strerror(errno));
+            return 1;
+        }
+    }
+
+    // What the keyboard was told last, and what it should be told.
+    bool sent_moving = false;
+    bool moving = false;
+    int64_t last_motion = 0;
+    int64_t last_report = -min_interval_ms;
+
+    for (;;) {
+        int64_t now = now_ms();
+        if (moving && now - last_motion >= idle_ms) {
+            moving = false;
+        }
+        if (moving != sent_moving && now - last_report >= min_interval_ms) {
+            if (send_motion_report(hidraw_fd, moving) < 0) {
+                return 1;
+            }
+            sent_moving = moving;
+            last_report = now;
+        }
+
+        // Wake up for the idle timeout, or when a batched change may be sent.
+        int timeout = -1;
+        if (moving != sent_moving) {
+            timeout = min_interval_ms - (now - last_report);
+        } else if (moving) {
+            timeout = idle_ms - (now - last_motion);
+        }
+        struct pollfd pfd = {.fd = evdev_fd, .events = POLLIN};
+        int ret = poll(&pfd, 1, timeout < 0 ? -1 : timeout);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return 1;
+        }
+        if (ret == 0) {
+            continue;
+        }
+
+        struct input_event events[64];
+        ssize_t len = read(evdev_fd, events, sizeof(events));
+        if (len < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            perror("read");
+            return 1;
+        }
+        for (size_t i = 0; i < len / sizeof(events[0]); i++) {
+            if (events[i].type == EV_REL && events[i].value != 0 &&
+                (events[i].code == REL_X || events[i].code == REL_Y)) {
+                moving = true;
+                last_motion = now_ms();
+            }
+        }
+    }
+}
@@ -0,0 +1,458 @@
+/*
+ * Copyright (c) 2024 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+// Simulates the LED link between the keyboard and a trackball running the
+// lkbm decoder, to measure how long commands take and how many of them get
+// through with a given host behaviour.
+//
+// The keyboard taps the lock keys like the macros in hid-trackball.dtsi, the
+// host toggles its lock state and sends the LED state to both devices after a
+// latency with jitter (optionally merging or dropping reports), and the
+// trackball decodes them with led_cmd.c and acknowledges frames with a Scroll
+// Lock pulse. The keyboard only counts a command as acknowledged if the module
+// would accept it: the pulse has to start within the acknowledgement window
+// that opens on the echo of the closing marker, must not be longer than
+// ACK_PULSE_MAX_MS, and has to decode to the mode that was set.
+//
+// With -t the keyboard taps the keys like &tb_cmd after a link probe: the
+// waits are stretched to the echo time of the host, and Caps Lock is tapped as
+// fast as Num Lock unless the host ignores short Caps Lock taps (-c).
+//
+//   LKBM=trackball_firmware/qmk/keyboards/ploopyco/trackball_nano/keymaps/lkbm
+//   cc -O2 -I$LKBM -o led-link-sim tools/led-link-sim/led-link-sim.c $LKBM/led_cmd.c
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "led_cmd.h"
+
+// Macro timings of hid-trackball.dtsi, and the defaults of &tb_cmd
+// (zmk,behavior-trackball-command.yml). A tap toggles the lock state on press
+// and is followed by the tap and wait time. These are copies, keep them in
+// step with the module.
+#define TAP_MS 5
+#define WAIT_MS 5
+#define CAPS_TAP_MS 100
+#define CAPS_WAIT_MS 60
+
+// Hosts that ignore short Caps Lock taps only toggle it after this hold time.
+#define SLOW_CAPS_HOLD_MS 100
+
+// Acceptance rules of hid-trackball-interface.c, and the default of its
+// ack-timeout-ms. These are copies as well.
+#define ACK_PULSE_UNIT_MS 15
+#define ACK_PULSE_MAX_MS (ACK_PULSE_UNIT_MS * 4)
+#define ACK_TIMEOUT_MS 100
+#define LOCAL_SLCK_ECHO_TIMEOUT_MS 250
+#define LOCAL_SLCK_ECHO_MIN_MS 50
+
+#define MAX_EVENTS 256
+#define MAX_SAMPLES 100000
+
+// The mode the module expects in the acknowledgement, or -1 for commands only
+// sent by the user's bindings, where it doesn't know the mode.
+struct sim_command {
+    const char *name;
+    const char *bits;
+    int mode;
+};
+
+static const struct sim_command commands[] = {
+    {"set_move", "", 0},     {"set_scroll", "00", 1},      {"set_snipe", "000", 2},
+    {"tg_scroll", "0", -1},  {"cyc_dpi", "1", -1},         {"set_dpi_2", "110", -1},
+    {"set_cpi_500", "10000011", -1},
+};
+
+enum sim_event_type {
+    EV_HOST_TOGGLE, // A lock key was pressed on the keyboard or the trackball
+    EV_KB_MARKER,   // The keyboard presses Scroll Lock for a frame marker
+    EV_HOST_SEND,   // The host sends its LED state to the devices
+    EV_TB_LEDS,     // The trackball receives an LED state
+    EV_TB_TICK,     // The trackball's decoder timer expires
+    EV_TB_ACK_END,  // The trackball ends its acknowledgement pulse
+    EV_KB_LEDS,     // The keyboard receives an LED state
+};
+
+struct sim_event {
+    uint32_t time;
+    uint32_t seq;
+    enum sim_event_type type;
+    uint8_t leds;
+};
+
+static struct {
+    int iterations;
+    int latency_ms;
+    int jitter_ms;
+    int drop_percent;
+    int merge_ms;
+    bool tb_cmd;
+    bool slow_caps_host;
+} opts = {
+    .iterations = 1000,
+    .latency_ms = 2,
+    .jitter_ms = 2,
+    .drop_percent = 0,
+    .merge_ms = 0,
+};
+
+// Key timings of the keyboard and the timeouts of the module, see set_timing().
+static struct {
+    uint32_t tap_ms;
+    uint32_t wait_ms;
+    uint32_t caps_tap_ms;
+    uint32_t caps_wait_ms;
+    uint32_t ack_timeout_ms;
+    uint32_t local_echo_timeout_ms;
+} timing;
+
+static struct sim_event queue[MAX_EVENTS];
+static int queue_len;
+static uint32_t queue_seq;
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state >> 32;
+}
+
+static void schedule(uint32_t time, enum sim_event_type type, uint8_t leds) {
+    if (queue_len == MAX_EVENTS) {
+        fprintf(stderr, "event queue overflow\n");
+        exit(1);
+    }
+    queue[queue_len++] = (struct sim_event){time, queue_seq++, type, leds};
+}
+
+static bool pop(struct sim_event *ev) {
+    if (queue_len == 0) {
+        return false;
+    }
+    int next = 0;
+    for (int i = 1; i < queue_len; i++) {
+        if (queue[i].time < queue[next].time ||
+            (queue[i].time == queue[next].time && queue[i].seq < queue[next].seq)) {
+            next = i;
+        }
+    }
+    *ev = queue[next];
+    queue[next] = queue[--queue_len];
+    return true;
+}
+
+// State of one simulated command round trip.
+static struct {
+    uint8_t host_leds;
+    bool send_pending;
+    uint32_t tb_delivery;
+    uint32_t kb_delivery;
+
+    led_cmd_decoder_t decoder;
+    bool scroll_lock_owned;
+    int mode;
+
+    // The module's view: our own marker edges waiting for their echo, the
+    // acknowledgement window and the pulse in it.
+    bool kb_slck;
+    int local_slck_edges;
+    uint32_t local_slck_at;
+    int marker_echoes;
+    bool ack_window_open;
+    uint32_t ack_window_until;
+    bool ack_pulse;
+    uint32_t ack_pulse_start;
+
+    uint32_t decoded_at;
+    bool decoded;
+    bool decoded_right;
+    uint32_t acked_at;
+} sim;
+
+static uint32_t link_delay(uint32_t now, uint32_t *last_delivery) {
+    uint32_t at = now + opts.latency_ms + (opts.jitter_ms ? rng() % (opts.jitter_ms + 1) : 0);
+    // Reports to one device don't overtake each other.
+    if (at < *last_delivery) {
+        at = *last_delivery;
+    }
+    *last_delivery = at;
+    return at;
+}
+
+static void trackball_event(uint32_t now, led_cmd_event_t event, const char *expected) {
+    if (event == LED_CMD_EVENT_FRAME_TIMEOUT) {
+        sim.scroll_lock_owned = sim.decoder.leds & LED_CMD_SCROLL_LOCK;
+        return;
+    }
+    if (event != LED_CMD_EVENT_FRAME || sim.decoded) {
+        return;
+    }
+
+    const cmd_frame_state_t *frame = &sim.decoder.closed_frame;
+    uint16_t value = 0;
+    for (const char *bit = expected; *bit; bit++) {
+        value = (value << 1) | (*bit == '1');
+    }
+    sim.decoded = true;
+    sim.decoded_at = now;
+    sim.decoded_right = frame->length == strlen(expected) && frame->value == value;
+
+    switch (FRAME_CMD(frame->length, frame->value)) {
+    case FRAME_SET_MOVE:
+        sim.mode = 0;
+        break;
+    case FRAME_SET_SCROLL:
+        sim.mode = 1;
+        break;
+    case FRAME_SET_SNIPE:
+        sim.mode = 2;
+        break;
+    case FRAME_TG_SCROLL:
+        sim.mode = sim.mode == 1 ? 0 : 1;
+        break;
+    default:
+        break;
+    }
+
+    // Acknowledge with a Scroll Lock pulse, like send_ack() in the keymap.
+    sim.scroll_lock_owned = !sim.scroll_lock_owned;
+    schedule(now + opts.latency_ms, EV_HOST_TOGGLE, LED_CMD_SCROLL_LOCK);
+    schedule(now + ACK_PULSE_UNIT_MS * (sim.mode + 1), EV_TB_ACK_END, 0);
+}
+
+// Follows hid_indicators_listener_cb() in the module.
+static void keyboard_slck_edge(uint32_t now, const struct sim_command *cmd) {
+    if (sim.local_slck_edges > 0 && now - sim.local_slck_at < timing.local_echo_timeout_ms) {
+        sim.local_slck_edges--;
+        if (++sim.marker_echoes % 2 == 0) {
+            sim.ack_window_open = true;
+            sim.ack_window_until = now + timing.ack_timeout_ms;
+        }
+        return;
+    }
+    if (sim.local_slck_edges > 0) {
+        sim.local_slck_edges = 0;
+        sim.marker_echoes = 0;
+    }
+
+    if (sim.ack_pulse) {
+        sim.ack_pulse = false;
+        uint32_t width = now - sim.ack_pulse_start;
+        int mode = (width + ACK_PULSE_UNIT_MS / 2) / ACK_PULSE_UNIT_MS - 1;
+        if (width <= ACK_PULSE_MAX_MS && (cmd->mode < 0 || mode == cmd->mode) && !sim.acked_at) {
+            sim.acked_at = now;
+        }
+        return;
+    }
+    if (sim.ack_window_open && now <= sim.ack_window_until) {
+        sim.ack_window_open = false;
+        sim.ack_pulse = true;
+        sim.ack_pulse_start = now;
+    }
+    // Anything else is trackball motion to the module.
+}
+
+static void schedule_tap(uint32_t t, uint8_t led, uint32_t tap_ms) {
+    if (led == LED_CMD_CAPS_LOCK && opts.slow_caps_host && tap_ms < SLOW_CAPS_HOLD_MS) {
+        return;
+    }
+    schedule(t, led == LED_CMD_SCROLL_LOCK ? EV_KB_MARKER : EV_HOST_TOGGLE, led);
+}
+
+static void run_command(const struct sim_command *cmd) {
+    memset(&sim, 0, sizeof(sim));
+    queue_len = 0;
+    sim.host_leds = rng() & (LED_CMD_NUM_LOCK | LED_CMD_CAPS_LOCK | LED_CMD_SCROLL_LOCK);
+    sim.mode = rng() % 3;
+    sim.kb_slck = sim.host_leds & LED_CMD_SCROLL_LOCK;
+    led_cmd_init(&sim.decoder, sim.host_leds);
+    sim.scroll_lock_owned = sim.host_leds & LED_CMD_SCROLL_LOCK;
+
+    // The keyboard plays the frame.
+    uint32_t t = 0;
+    schedule_tap(t, LED_CMD_SCROLL_LOCK, timing.tap_ms);
+    t += timing.tap_ms + timing.wait_ms;
+    for (const char *bit = cmd->bits; *bit; bit++) {
+        bool caps = *bit == '1';
+        uint8_t led = caps ? LED_CMD_CAPS_LOCK : LED_CMD_NUM_LOCK;
+        uint32_t tap_ms = caps ? timing.caps_tap_ms : timing.tap_ms;
+        uint32_t step_ms = tap_ms + (caps ? timing.caps_wait_ms : timing.wait_ms);
+        schedule_tap(t, led, tap_ms);
+        schedule_tap(t + step_ms, led, tap_ms);
+        t += 2 * step_ms;
+    }
+    schedule_tap(t, LED_CMD_SCROLL_LOCK, timing.tap_ms);
+
+    struct sim_event ev;
+    while (pop(&ev)) {
+        switch (ev.type) {
+        case EV_KB_MARKER:
+            sim.local_slck_edges++;
+            sim.local_slck_at = ev.time;
+            // fall through
+        case EV_HOST_TOGGLE:
+            sim.host_leds ^= ev.leds;
+            if (!sim.send_pending) {
+                sim.send_pending = true;
+                schedule(ev.time + opts.merge_ms, EV_HOST_SEND, 0);
+            }
+            break;
+        case EV_HOST_SEND:
+            sim.send_pending = false;
+            if ((int)(rng() % 100) >= opts.drop_percent) {
+                schedule(link_delay(ev.time, &sim.tb_delivery), EV_TB_LEDS, sim.host_leds);
+            }
+            if ((int)(rng() % 100) >= opts.drop_percent) {
+                schedule(link_delay(ev.time, &sim.kb_delivery), EV_KB_LEDS, sim.host_leds);
+            }
+            break;
+        case EV_TB_LEDS:
+            trackball_event(ev.time,
+                            led_cmd_update(&sim.decoder, ev.leds, sim.scroll_lock_owned, ev.time),
+                            cmd->bits);
+            if (led_cmd_remaining(&sim.decoder, ev.time)) {
+                schedule(ev.time + led_cmd_remaining(&sim.decoder, ev.time), EV_TB_TICK, 0);
+            }
+            break;
+        case EV_TB_TICK:
+            trackball_event(ev.time, led_cmd_tick(&sim.decoder, ev.time), cmd->bits);
+            break;
+        case EV_TB_ACK_END:
+            sim.scroll_lock_owned = !sim.scroll_lock_owned;
+            schedule(ev.time + opts.latency_ms, EV_HOST_TOGGLE, LED_CMD_SCROLL_LOCK);
+            break;
+        case EV_KB_LEDS:
+            if (!!(ev.leds & LED_CMD_SCROLL_LOCK) != sim.kb_slck) {
+                sim.kb_slck = !sim.kb_slck;
+                keyboard_slck_edge(ev.time, cmd);
+            }
+            break;
+        }
+    }
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t *samples, int n, int p) {
+    return n ? samples[(n - 1) * p / 100] : 0;
+}
+
+// Without -t, the macros of hid-trackball.dtsi with the module's default
+// timeouts. With -t, &tb_cmd after a link probe, which measured the slowest
+// echo the host can give and whether it echoed a short Caps Lock tap.
+static void set_timing(void) {
+    timing.tap_ms = TAP_MS;
+    timing.wait_ms = WAIT_MS;
+    timing.caps_tap_ms = CAPS_TAP_MS;
+    timing.caps_wait_ms = CAPS_WAIT_MS;
+    timing.ack_timeout_ms = ACK_TIMEOUT_MS;
+    timing.local_echo_timeout_ms = LOCAL_SLCK_ECHO_TIMEOUT_MS;
+    if (!opts.tb_cmd) {
+        return;
+    }
+
+    uint32_t echo_ms = opts.merge_ms + opts.latency_ms + opts.jitter_ms;
+    if (echo_ms < 1) {
+        echo_ms = 1;
+    }
+    if (timing.wait_ms < echo_ms) {
+        timing.wait_ms = echo_ms;
+    }
+    if (!opts.slow_caps_host) {
+        timing.caps_tap_ms = timing.tap_ms;
+        timing.caps_wait_ms = timing.wait_ms;
+    } else if (timing.caps_wait_ms < echo_ms) {
+        timing.caps_wait_ms = echo_ms;
+    }
+    if (timing.ack_timeout_ms < 2 * echo_ms) {
+        timing.ack_timeout_ms = 2 * echo_ms;
+    }
+    timing.local_echo_timeout_ms =
+        3 * echo_ms > LOCAL_SLCK_ECHO_MIN_MS ? 3 * echo_ms : LOCAL_SLCK_ECHO_MIN_MS;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-n iterations] [-l latency_ms] [-j jitter_ms] [-d drop_percent] "
+            "[-m merge_ms] [-s seed] [-t] [-c]\n",
+            name);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:l:j:d:m:s:tc")) != -1) {
+        switch (opt) {
+        case 'n':
+            opts.iterations = atoi(optarg);
+            break;
+        case 'l':
+            opts.latency_ms = atoi(optarg);
+            break;
+        case 'j':
+            opts.jitter_ms = atoi(optarg);
+            break;
+        case 'd':
+            opts.drop_percent = atoi(optarg);
+            break;
+        case 'm':
+            opts.merge_ms = atoi(optarg);
+            break;
+        case 's':
+            rng_state = strtoull(optarg, NULL, 0) | 1;
+            break;
+        case 't':
+            opts.tb_cmd = true;
+            break;
+        case 'c':
+            opts.slow_caps_host = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (opts.iterations <= 0 || opts.iterations > MAX_SAMPLES || opts.latency_ms < 0 ||
+        opts.jitter_ms < 0 || opts.drop_percent < 0 || opts.merge_ms < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    set_timing();
+
+    static uint32_t decode_ms[MAX_SAMPLES];
+    static uint32_t ack_ms[MAX_SAMPLES];
+
+    printf("%-12s %8s %8s %8s %8s %8s %8s %8s\n", "command", "ok%", "ack%", "p50", "p90", "p99",
+           "ack p50", "ack p99");
+    for (size_t c = 0; c < sizeof(commands) / sizeof(commands[0]); c++) {
+        int decoded = 0, acked = 0;
+        for (int i = 0; i < opts.iterations; i++) {
+            run_command(&commands[c]);
+            if (sim.decoded && sim.decoded_right) {
+                decode_ms[decoded++] = sim.decoded_at;
+                if (sim.acked_at) {
+                    ack_ms[acked++] = sim.acked_at;
+                }
+            }
+        }
+        qsort(decode_ms, decoded, sizeof(decode_ms[0]), compare_u32);
+        qsort(ack_ms, acked, sizeof(ack_ms[0]), compare_u32);
+        printf("%-12s %8.1f %8.1f %8u %8u %8u %8u %8u\n", commands[c].name,
+               100.0 * decoded / opts.iterations, 100.0 * acked / opts.iterations,
+               percentile(decode_ms, decoded, 50), percentile(decode_ms, decoded, 90),
+               percentile(decode_ms, decoded, 99), percentile(ack_ms, acked, 50),
+               percentile(ack_ms, acked, 99));
+    }
+    return 0;
+}
@@ -19,87 +19,246 @@
  */
 #include QMK_KEYBOARD_H
 #include "print.h"
+#include "led_cmd.h"
 
-#define NUM_LOCK_BITMASK 0b01
-#define CAPS_LOCK_BITMASK 0b10
-
-// World record for fastest index finger tapping is 1092 taps per minute, which
-// is 55ms for a single tap.
-// https://recordsetter.com/world-record/index-finger-taps-minute/46066
-#define LED_CMD_TIMEOUT 25
+// Every framed command is acknowledged with a Scroll Lock pulse that is
+// (mode + 1) units long, mode being 0 for move, 1 for scroll and 2 for snipe.
+#define ACK_PULSE_UNIT 15
+// Scroll Lock is on while the trackball moves, and turned off again after
+// SCROLL_LOCK_TIMEOUT without motion. That is only checked every
+// SCROLL_LOCK_HEARTBEAT, so motion reports just note down the time.
 #define SCROLL_LOCK_TIMEOUT 200
-#define DELTA_X_THRESHOLD 60
-#define DELTA_Y_THRESHOLD 15
-
-typedef enum {
-    // You could theoretically define 0b00 and send it by having a macro send
-    // the second tap after LED_CMD_TIMEOUT has elapsed.
-    // CMD_EXTRA = 0b00,
-    TG_SCROLL = 0b01,
-    CYC_DPI   = 0b10,
-    CMD_RESET = 0b11 // CMD_ prefix to avoid clash with QMK macro
-} led_cmd_t;
+#define SCROLL_LOCK_HEARTBEAT 50
+// A motion session only starts once the movement adds up to MOTION_MIN_COUNTS
+// (|x| + |y|) within MOTION_WINDOW, so bumping the desk doesn't signal motion.
+#ifndef MOTION_MIN_COUNTS
+#    define MOTION_MIN_COUNTS 4
+#endif
+#ifndef MOTION_WINDOW
+#    define MOTION_WINDOW 50
+#endif
+// Counts of horizontal and vertical movement that make up one wheel step in
+// scroll mode, until they are changed over extended commands (in steps of
+// SCROLL_DIVISOR_STEP).
+#ifndef SCROLL_DIVISOR_H
+#    define SCROLL_DIVISOR_H 60
+#endif
+#ifndef SCROLL_DIVISOR_V
+#    define SCROLL_DIVISOR_V 15
+#endif
+#define SCROLL_DIVISOR_STEP 5
+// Momentum scrolling keeps scrolling after the ball stopped, slowing down by
+// the friction (in 1/256ths of the speed kept per interval) until the speed
+// drops below the cutoff (in counts per interval). A friction of 0 disables it.
+#ifndef SCROLL_MOMENTUM_FRICTION
+#    define SCROLL_MOMENTUM_FRICTION 0
+#endif
+#ifndef SCROLL_MOMENTUM_CUTOFF
+#    define SCROLL_MOMENTUM_CUTOFF 2
+#endif
+#define SCROLL_MOMENTUM_INTERVAL 16
+// Friction steps that can be set over extended commands.
+#define SCROLL_MOMENTUM_FRICTION_BASE 192
+#define SCROLL_MOMENTUM_FRICTION_STEP 4
+// With high-resolution scrolling the host splits every wheel tick into this
+// many steps, so the divisors above are still counts per full tick.
+#ifdef POINTING_DEVICE_HIRES_SCROLL_ENABLE
+#    define SCROLL_RESOLUTION pointing_device_get_hires_scroll_resolution()
+#else
+#    define SCROLL_RESOLUTION 1
+#endif
 
 // State
-static bool   scroll_enabled  = true;
-static bool   num_lock_state  = false;
-static bool   caps_lock_state = false;
-static bool   in_cmd_window   = false;
-static int8_t delta_x         = 0;
-static int8_t delta_y         = 0;
-
-static deferred_token scroll_lock_timer;
-static bool           scroll_lock_timer_enabled = false;
-
-typedef struct {
-    led_cmd_t led_cmd;
-    uint8_t   num_lock_count;
-    uint8_t   caps_lock_count;
-} cmd_window_state_t;
+static bool   scroll_enabled    = true;
+static bool   snipe_enabled     = false;
+static bool   in_ack            = false;
+static uint8_t scroll_divisor_h = SCROLL_DIVISOR_H;
+static uint8_t scroll_divisor_v = SCROLL_DIVISOR_V;
+
+// Scroll movement in 1/SCROLL_RESOLUTION counts that didn't make up a full
+// wheel step yet, carried over to the next report. They saturate instead of
+// wrapping around, which would reverse the scroll direction.
+static int16_t delta_x = 0;
+static int16_t delta_y = 0;
+
+// Scroll speed in 1/16 counts per SCROLL_MOMENTUM_INTERVAL, averaged over the
+// last reports and decaying while gliding.
+static uint8_t        momentum_friction  = SCROLL_MOMENTUM_FRICTION;
+static int16_t        momentum_x         = 0;
+static int16_t        momentum_y         = 0;
+static uint16_t       momentum_timestamp = 0;
+static bool           momentum_gliding   = false;
+static deferred_token momentum_timer     = INVALID_DEFERRED_TOKEN;
+
+// DPI option used outside of snipe mode, snipe mode uses the one after it.
+static uint8_t move_dpi_index = 0;
+
+// The Scroll Lock state we last drove the host to. Edges that move the host
+// away from it are frame markers sent by the keyboard.
+static bool scroll_lock_owned = false;
+
+static bool     motion_session_active    = false;
+static uint16_t motion_session_timestamp = 0;
+static uint16_t motion_window_counts     = 0;
+static uint16_t motion_window_timestamp  = 0;
+
+
+static led_cmd_decoder_t led_decoder;
+static deferred_token    led_cmd_timer = INVALID_DEFERRED_TOKEN;
 
 // Dummy
 const uint16_t PROGMEM keymaps[][MATRIX_ROWS][MATRIX_COLS] = {{{KC_NO}}};
 
-uint32_t scroll_lock_timeout(uint32_t trigger_time, void *cb_arg) {
-    if (host_keyboard_led_state().scroll_lock) {
+// Raises Scroll Lock unless our own edge would be taken for the closing marker
+// of an open frame, or change the length of an acknowledgement.
+static void update_scroll_lock(bool moving) {
+    if (scroll_lock_owned != moving && !led_decoder.in_cmd_frame && !in_ack) {
+        scroll_lock_owned = moving;
         tap_code(KC_SCROLL_LOCK);
     }
-    scroll_lock_timer_enabled = false;
+}
+
+uint32_t motion_session_heartbeat(uint32_t trigger_time, void *cb_arg) {
+    bool moving = timer_elapsed(motion_session_timestamp) < SCROLL_LOCK_TIMEOUT;
+
+    update_scroll_lock(moving);
+    if (moving || scroll_lock_owned) {
+        return SCROLL_LOCK_HEARTBEAT;
+    }
+    motion_session_active = false;
     return 0; // Don't repeat
 }
 
-report_mouse_t pointing_device_task_user(report_mouse_t mouse_report) {
-    if (mouse_report.x + mouse_report.y > 0) {
-        if (!host_keyboard_led_state().scroll_lock) {
-            tap_code(KC_SCROLL_LOCK);
-        }
+static bool detect_motion(report_mouse_t *mouse_report) {
+    uint16_t magnitude = ABS(mouse_report->x) + ABS(mouse_report->y);
+    if (magnitude == 0) {
+        return false;
+    }
+    if (motion_session_active) {
+        return true;
+    }
+    if (timer_elapsed(motion_window_timestamp) > MOTION_WINDOW) {
+        motion_window_counts    = 0;
+        motion_window_timestamp = timer_read();
+    }
+    motion_window_counts += magnitude;
+    return motion_window_counts >= MOTION_MIN_COUNTS;
+}
 
-        if (!scroll_lock_timer_enabled) {
-            scroll_lock_timer_enabled = true;
-            scroll_lock_timer = defer_exec(SCROLL_LOCK_TIMEOUT, scroll_lock_timeout, NULL);
-        } else {
-            extend_deferred_exec(scroll_lock_timer, SCROLL_LOCK_TIMEOUT);
-        }
+static void motion_detected(void) {
+    motion_session_timestamp = timer_read();
+    if (!motion_session_active) {
+        motion_session_active = true;
+        update_scroll_lock(true);
+        defer_exec(SCROLL_LOCK_HEARTBEAT, motion_session_heartbeat, NULL);
     }
-    if (scroll_enabled) {
-        delta_x += mouse_report.x;
-        delta_y += mouse_report.y;
-
-        if (delta_x > DELTA_X_THRESHOLD) {
-            mouse_report.h = -1;
-            delta_x        = 0;
-        } else if (delta_x < -DELTA_X_THRESHOLD) {
-            mouse_report.h = 1;
-            delta_x        = 0;
-        }
+}
 
-        if (delta_y > DELTA_Y_THRESHOLD) {
-            mouse_report.v = 1;
-            delta_y        = 0;
-        } else if (delta_y < -DELTA_Y_THRESHOLD) {
-            mouse_report.v = -1;
-            delta_y        = 0;
-        }
+// Fast spins emit as many wheel steps as they are worth in a single report.
+static mouse_hv_report_t scroll_steps(int16_t *delta, mouse_xy_report_t motion, uint8_t divisor) {
+    int32_t sum = (int32_t)*delta + (int32_t)motion * SCROLL_RESOLUTION;
+    if (sum > INT16_MAX) {
+        sum = INT16_MAX;
+    } else if (sum < INT16_MIN) {
+        sum = INT16_MIN;
+    }
+    *delta = sum;
+
+    int16_t steps = *delta / divisor;
+    if (steps > HV_REPORT_MAX) {
+        steps = HV_REPORT_MAX;
+    } else if (steps < HV_REPORT_MIN) {
+        steps = HV_REPORT_MIN;
+    }
+    *delta -= steps * divisor;
+    return steps;
+}
+
+static void stop_momentum(void) {
+    if (momentum_timer != INVALID_DEFERRED_TOKEN) {
+        cancel_deferred_exec(momentum_timer);
+        momentum_timer = INVALID_DEFERRED_TOKEN;
+    }
+    momentum_x       = 0;
+    momentum_y       = 0;
+    momentum_gliding = false;
+}
+
+static int16_t momentum_decay(int16_t momentum) {
+    return (int32_t)momentum * momentum_friction / 256;
+}
+
+uint32_t momentum_step(uint32_t trigger_time, void *cb_arg) {
+    momentum_gliding = true;
+    momentum_x       = momentum_decay(momentum_x);
+    momentum_y       = momentum_decay(momentum_y);
+    if (!scroll_enabled || (ABS(momentum_x) < SCROLL_MOMENTUM_CUTOFF * 16 &&
+                            ABS(momentum_y) < SCROLL_MOMENTUM_CUTOFF * 16)) {
+        momentum_timer = INVALID_DEFERRED_TOKEN;
+        stop_momentum();
+        return 0; // Don't repeat
+    }
+
+    report_mouse_t report = pointing_device_get_report();
+    report.x = 0;
+    report.y = 0;
+    report.h = -scroll_steps(&delta_x, momentum_x / 16, scroll_divisor_h);
+    report.v = scroll_steps(&delta_y, momentum_y / 16, scroll_divisor_v);
+    if (report.h != 0 || report.v != 0) {
+        pointing_device_set_report(report);
+        pointing_device_send();
+    }
+    return SCROLL_MOMENTUM_INTERVAL;
+}
+
+// Capped so that a glide never moves more than a single report can.
+static int16_t momentum_speed(mouse_xy_report_t motion, uint16_t elapsed) {
+    int16_t speed = (int16_t)motion * 16 * SCROLL_MOMENTUM_INTERVAL / elapsed;
+    if (speed > INT8_MAX * 16) {
+        return INT8_MAX * 16;
+    }
+    if (speed < INT8_MIN * 16) {
+        return INT8_MIN * 16;
+    }
+    return speed;
+}
+
+// Glides start once the ball didn't move for a whole interval, any motion or
+// button press stops them.
+static void track_momentum(report_mouse_t *mouse_report) {
+    bool moving = mouse_report->x != 0 || mouse_report->y != 0;
+    if (mouse_report->buttons || (momentum_gliding && moving)) {
+        stop_momentum();
+    }
+    if (momentum_friction == 0 || mouse_report->buttons || !moving) {
+        return;
+    }
+
+    uint16_t elapsed = timer_elapsed(momentum_timestamp);
+    momentum_timestamp = timer_read();
+    if (momentum_timer == INVALID_DEFERRED_TOKEN || elapsed > SCROLL_MOMENTUM_INTERVAL) {
+        elapsed = SCROLL_MOMENTUM_INTERVAL;
+    } else if (elapsed == 0) {
+        elapsed = 1;
+    }
+    momentum_x = (momentum_x + momentum_speed(mouse_report->x, elapsed)) / 2;
+    momentum_y = (momentum_y + momentum_speed(mouse_report->y, elapsed)) / 2;
+
+    if (momentum_timer == INVALID_DEFERRED_TOKEN) {
+        momentum_timer = defer_exec(SCROLL_MOMENTUM_INTERVAL, momentum_step, NULL);
+    } else {
+        extend_deferred_exec(momentum_timer, SCROLL_MOMENTUM_INTERVAL);
+    }
+}
+
+report_mouse_t pointing_device_task_user(report_mouse_t mouse_report) {
+    if (detect_motion(&mouse_report)) {
+        motion_detected();
+    }
+    if (scroll_enabled) {
+        track_momentum(&mouse_report);
+        mouse_report.h = -scroll_steps(&delta_x, mouse_report.x, scroll_divisor_h);
+        mouse_report.v = scroll_steps(&delta_y, mouse_report.y, scroll_divisor_v);
         mouse_report.x = 0;
         mouse_report.y = 0;
     }
@@ -107,16 +266,22 @@ report_mouse_t pointing_device_task_user(report_mouse_t mouse_report) {
 }
 
 void keyboard_post_init_user(void) {
-    num_lock_state  = host_keyboard_led_state().num_lock;
-    caps_lock_state = host_keyboard_led_state().caps_lock;
+    led_cmd_init(&led_decoder, host_keyboard_led_state().raw);
+    scroll_lock_owned = host_keyboard_led_state().scroll_lock;
+    move_dpi_index    = keyboard_config.dpi_config;
 }
 
-uint32_t command_timeout(uint32_t trigger_time, void *cb_arg) {
-    cmd_window_state_t *cmd_window_state = (cmd_window_state_t *)cb_arg;
+static void set_input_mode(bool scroll, bool snipe) {
+    scroll_enabled = scroll;
+    snipe_enabled  = snipe;
+    set_dpi_index(snipe ? move_dpi_index + 1 : move_dpi_index);
+}
+
+static void dispatch_window(led_cmd_t led_cmd) {
 #   ifdef CONSOLE_ENABLE
-    uprintf("Received command 0b%02b (", cmd_window_state->led_cmd);
+    uprintf("Received command 0b%02b (", led_cmd);
 #   endif
-    switch (cmd_window_state->led_cmd) {
+    switch (led_cmd) {
         case TG_SCROLL:
 #           ifdef CONSOLE_ENABLE
             uprint("TG_SCROLL)\n");
@@ -142,50 +307,180 @@ uint32_t command_timeout(uint32_t trigger_time, void *cb_arg) {
             // Ignore unrecognised commands.
             break;
     }
-    cmd_window_state->led_cmd         = 0;
-    cmd_window_state->num_lock_count  = 0;
-    cmd_window_state->caps_lock_count = 0;
-    in_cmd_window                     = false;
+}
 
+static void dispatch_ext_frame(ext_opcode_t opcode, uint8_t operand) {
+    switch (opcode) {
+        case EXT_SET_CPI:
+#           ifdef CONSOLE_ENABLE
+            uprint("SET_CPI)\n");
+#           endif
+            pointing_device_set_cpi((operand + 1) * 125);
+            break;
+        case EXT_SET_SCROLL_DIVISOR_V:
+#           ifdef CONSOLE_ENABLE
+            uprint("SET_SCROLL_DIVISOR_V)\n");
+#           endif
+            scroll_divisor_v = (operand + 1) * SCROLL_DIVISOR_STEP;
+            delta_y          = 0;
+            break;
+        case EXT_SET_SCROLL_DIVISOR_H:
+#           ifdef CONSOLE_ENABLE
+            uprint("SET_SCROLL_DIVISOR_H)\n");
+#           endif
+            scroll_divisor_h = (operand + 1) * SCROLL_DIVISOR_STEP;
+            delta_x          = 0;
+            break;
+        case EXT_SET_ACCEL:
+#           ifdef CONSOLE_ENABLE
+            uprint("SET_ACCEL)\n");
+#           endif
+            set_accel_profile(operand);
+            break;
+        case EXT_SET_MOMENTUM:
+#           ifdef CONSOLE_ENABLE
+            uprint("SET_MOMENTUM)\n");
+#           endif
+            stop_momentum();
+            momentum_friction = operand ? SCROLL_MOMENTUM_FRICTION_BASE + operand * SCROLL_MOMENTUM_FRICTION_STEP : 0;
+            break;
+        default:
+#           ifdef CONSOLE_ENABLE
+            uprint("unknown)\n");
+#           endif
+            // Ignore unrecognised commands.
+            break;
+    }
+}
+
+static void dispatch_frame(const cmd_frame_state_t *frame) {
+#   ifdef CONSOLE_ENABLE
+    uprintf("Received frame %d:0b%08b (", frame->length, frame->value);
+#   endif
+    if (frame->length == FRAME_EXT_LENGTH && (frame->value & FRAME_EXT_FLAG)) {
+        dispatch_ext_frame((frame->value >> 4) & 0b111, frame->value & 0x0F);
+        return;
+    }
+    switch (FRAME_CMD(frame->length, frame->value)) {
+        case FRAME_SET_MOVE:
+#           ifdef CONSOLE_ENABLE
+            uprint("SET_MOVE)\n");
+#           endif
+            set_input_mode(false, false);
+            break;
+        case FRAME_SET_SCROLL:
+#           ifdef CONSOLE_ENABLE
+            uprint("SET_SCROLL)\n");
+#           endif
+            set_input_mode(true, false);
+            break;
+        case FRAME_SET_SNIPE:
+#           ifdef CONSOLE_ENABLE
+            uprint("SET_SNIPE)\n");
+#           endif
+            set_input_mode(false, true);
+            break;
+        case FRAME_SET_DPI ... FRAME_SET_DPI_MAX:
+#           ifdef CONSOLE_ENABLE
+            uprint("SET_DPI)\n");
+#           endif
+            move_dpi_index = frame->value & 0b11;
+            set_input_mode(scroll_enabled, snipe_enabled);
+            break;
+        case FRAME_TG_SCROLL:
+#           ifdef CONSOLE_ENABLE
+            uprint("TG_SCROLL)\n");
+#           endif
+            scroll_enabled = !scroll_enabled;
+            break;
+        case FRAME_CYC_DPI:
+#           ifdef CONSOLE_ENABLE
+            uprint("CYC_DPI)\n");
+#           endif
+            cycle_dpi();
+            move_dpi_index = keyboard_config.dpi_config;
+            snipe_enabled  = false;
+            break;
+        default:
+#           ifdef CONSOLE_ENABLE
+            uprint("unknown)\n");
+#           endif
+            // Ignore unrecognised commands.
+            break;
+    }
+}
+
+uint32_t ack_pulse_end(uint32_t trigger_time, void *cb_arg) {
+    if (led_decoder.in_cmd_frame) {
+        return LED_CMD_TIMEOUT;
+    }
+    scroll_lock_owned = !scroll_lock_owned;
+    tap_code(KC_SCROLL_LOCK);
+    in_ack = false;
     return 0; // Don't repeat
 }
 
-bool led_update_user(led_t led_state) {
-    static cmd_window_state_t cmd_window_state = {
-      .led_cmd = 0b00,
-      .num_lock_count = 0,
-      .caps_lock_count = 0
-    };
-
-    // Start timer to end command window if we are not already in the middle of
-    // one.
-    if (!in_cmd_window) {
-        in_cmd_window = true;
-        defer_exec(LED_CMD_TIMEOUT, command_timeout, &cmd_window_state);
-    }
-
-    // Set num lock and caps lock bits when each is toggled on and off within
-    // the window.
-    if (led_state.num_lock != num_lock_state) {
-        cmd_window_state.num_lock_count++;
-
-        if (cmd_window_state.num_lock_count == 2) {
-            cmd_window_state.led_cmd |= NUM_LOCK_BITMASK;
-            cmd_window_state.num_lock_count = 0;
-        }
+static void send_ack(void) {
+    if (in_ack) {
+        return;
     }
+    uint8_t mode = scroll_enabled ? 1 : snipe_enabled ? 2 : 0;
 
-    if (led_state.caps_lock != caps_lock_state) {
-        cmd_window_state.caps_lock_count++;
+    in_ack            = true;
+    scroll_lock_owned = !scroll_lock_owned;
+    tap_code(KC_SCROLL_LOCK);
+    defer_exec(ACK_PULSE_UNIT * (mode + 1), ack_pulse_end, NULL);
+}
 
-        if (cmd_window_state.caps_lock_count == 2) {
-            cmd_window_state.led_cmd |= CAPS_LOCK_BITMASK;
-            cmd_window_state.caps_lock_count = 0;
-        }
+static void handle_led_cmd_event(led_cmd_event_t event) {
+    switch (event) {
+        case LED_CMD_EVENT_WINDOW:
+            dispatch_window(led_decoder.window_cmd);
+            break;
+        case LED_CMD_EVENT_FRAME:
+            // The closing marker leaves the host where we want it, unless
+            // another trackball toggled Scroll Lock during the frame.
+            scroll_lock_owned = led_decoder.leds & LED_CMD_SCROLL_LOCK;
+            dispatch_frame(&led_decoder.closed_frame);
+            send_ack();
+            break;
+        case LED_CMD_EVENT_FRAME_TIMEOUT:
+#           ifdef CONSOLE_ENABLE
+            uprint("Frame timed out\n");
+#           endif
+            // Adopt whatever Scroll Lock state the host ended up in, so a stray
+            // edge (e.g. the user pressing Scroll Lock) doesn't keep us out of
+            // sync.
+            scroll_lock_owned = led_decoder.leds & LED_CMD_SCROLL_LOCK;
+            break;
+        default:
+            break;
+    }
+}
+
+uint32_t led_cmd_timeout(uint32_t trigger_time, void *cb_arg) {
+    handle_led_cmd_event(led_cmd_tick(&led_decoder, timer_read32()));
+
+    uint32_t remaining = led_cmd_remaining(&led_decoder, timer_read32());
+    if (remaining == 0) {
+        led_cmd_timer = INVALID_DEFERRED_TOKEN;
     }
+    return remaining;
+}
 
-    // Keep our copy of the LED states in sync with the host.
-    num_lock_state  = led_state.num_lock;
-    caps_lock_state = led_state.caps_lock;
+bool led_update_user(led_t led_state) {
+    handle_led_cmd_event(led_cmd_update(&led_decoder, led_state.raw, scroll_lock_owned, timer_read32()));
+
+    uint32_t remaining = led_cmd_remaining(&led_decoder, timer_read32());
+    if (remaining == 0) {
+        if (led_cmd_timer != INVALID_DEFERRED_TOKEN) {
+            cancel_deferred_exec(led_cmd_timer);
+            led_cmd_timer = INVALID_DEFERRED_TOKEN;
+        }
+    } else if (led_cmd_timer == INVALID_DEFERRED_TOKEN) {
+        led_cmd_timer = defer_exec(remaining, led_cmd_timeout, NULL);
+    } else {
+        extend_deferred_exec(led_cmd_timer, remaining);
+    }
     return true;
 }
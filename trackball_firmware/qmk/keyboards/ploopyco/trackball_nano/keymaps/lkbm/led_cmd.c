@@ -0,0 +1,199 @@
+/* Copyright 2022 Aidan Gauland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "led_cmd.h"
+
+// Timestamps wrap around, so deadlines are compared by their difference.
+static bool deadline_passed(uint32_t deadline, uint32_t now) {
+    return (int32_t)(now - deadline) >= 0;
+}
+
+static void reset_window(led_cmd_decoder_t *decoder) {
+    decoder->led_cmd         = 0;
+    decoder->num_lock_count  = 0;
+    decoder->caps_lock_count = 0;
+    decoder->in_cmd_window   = false;
+}
+
+static void reset_frame(led_cmd_decoder_t *decoder) {
+    decoder->frame.value           = 0;
+    decoder->frame.length          = 0;
+    decoder->frame.num_lock_count  = 0;
+    decoder->frame.caps_lock_count = 0;
+    decoder->in_cmd_frame          = false;
+}
+
+void led_cmd_init(led_cmd_decoder_t *decoder, uint8_t leds) {
+    decoder->leds = leds;
+    reset_window(decoder);
+    reset_frame(decoder);
+}
+
+#if LED_CMD_ADDRESS_LENGTH > 0
+// Frames for addressed trackballs are the address and exactly 8 more bits: an
+// extended command as it is, or a 0 and then the command behind a 1 that marks
+// where it starts (00000100 is SET_SCROLL). With a fixed length, a frame that a
+// Scroll Lock edge of another trackball opened (its motion signal or its
+// acknowledgement) is always too short when the next marker arrives, so that
+// marker opens a frame instead of closing it. Unaddressed frames are dropped
+// the same way.
+#    define ADDRESSED_FRAME_LENGTH (LED_CMD_ADDRESS_LENGTH + FRAME_EXT_LENGTH)
+#endif
+
+// Whether a Scroll Lock edge inside the frame closes it.
+static bool frame_complete(const cmd_frame_state_t *frame) {
+#if LED_CMD_ADDRESS_LENGTH > 0
+    return frame->length == ADDRESSED_FRAME_LENGTH;
+#else
+    (void)frame;
+    return true;
+#endif
+}
+
+// Strips our address from the frame and unpacks the command behind it, returns
+// false if it is meant for another trackball.
+static bool accept_frame_address(cmd_frame_state_t *frame) {
+#if LED_CMD_ADDRESS_LENGTH > 0
+    if ((frame->value >> FRAME_EXT_LENGTH) != LED_CMD_ADDRESS) {
+        return false;
+    }
+    uint8_t payload = frame->value & ((1 << FRAME_EXT_LENGTH) - 1);
+    if (payload & FRAME_EXT_FLAG) {
+        frame->length = FRAME_EXT_LENGTH;
+        frame->value  = payload;
+        return true;
+    }
+    if (payload == 0) {
+        return false;
+    }
+    frame->length = 0;
+    while (payload >> (frame->length + 1)) {
+        frame->length++;
+    }
+    frame->value = payload & ((1 << frame->length) - 1);
+#else
+    (void)frame;
+#endif
+    return true;
+}
+
+static void shift_into_frame(cmd_frame_state_t *frame, uint8_t bit) {
+    // Overlong frames are invalid; pushing the length past the maximum makes
+    // sure they never match a command.
+    if (frame->length <= LED_FRAME_MAX_LENGTH) {
+        frame->value = (frame->value << 1) | bit;
+        frame->length++;
+    }
+}
+
+led_cmd_event_t led_cmd_update(led_cmd_decoder_t *decoder, uint8_t leds, bool scroll_lock_owned, uint32_t now) {
+    uint8_t changed             = leds ^ decoder->leds;
+    bool    num_lock_changed    = changed & LED_CMD_NUM_LOCK;
+    bool    caps_lock_changed   = changed & LED_CMD_CAPS_LOCK;
+    bool    scroll_lock_changed = changed & LED_CMD_SCROLL_LOCK;
+    bool    scroll_lock         = leds & LED_CMD_SCROLL_LOCK;
+
+    // Keep our copy of the LED states in sync with the host.
+    decoder->leds = leds;
+
+    // A Scroll Lock edge that moves the host away from the state we drove it to
+    // opens a frame. It always comes before the payload in the same report.
+    bool frame_opened = false;
+    if (scroll_lock_changed && !decoder->in_cmd_frame && scroll_lock != scroll_lock_owned) {
+        reset_window(decoder);
+        decoder->in_cmd_frame = true;
+        frame_opened          = true;
+    }
+
+    if (decoder->in_cmd_frame) {
+        if (num_lock_changed || caps_lock_changed || scroll_lock_changed) {
+            decoder->frame_deadline = now + LED_FRAME_TIMEOUT;
+        }
+
+        cmd_frame_state_t *frame = &decoder->frame;
+        if (num_lock_changed && ++frame->num_lock_count == 2) {
+            frame->num_lock_count = 0;
+            shift_into_frame(frame, 0);
+        }
+        if (caps_lock_changed && ++frame->caps_lock_count == 2) {
+            frame->caps_lock_count = 0;
+            shift_into_frame(frame, 1);
+        }
+
+        // The closing marker comes after the payload, dispatch right away.
+        if (scroll_lock_changed && !frame_opened) {
+            if (!frame_complete(frame)) {
+                // Not the closing marker of any frame, so it opens one.
+                reset_frame(decoder);
+                decoder->in_cmd_frame = true;
+                return LED_CMD_EVENT_NONE;
+            }
+            decoder->closed_frame = *frame;
+            reset_frame(decoder);
+            if (accept_frame_address(&decoder->closed_frame)) {
+                return LED_CMD_EVENT_FRAME;
+            }
+        }
+        return LED_CMD_EVENT_NONE;
+    }
+
+    // The windows carry no address, so addressed trackballs ignore them.
+    if (LED_CMD_ADDRESS_LENGTH > 0 || (!num_lock_changed && !caps_lock_changed)) {
+        return LED_CMD_EVENT_NONE;
+    }
+
+    // Start the command window if we are not already in the middle of one.
+    if (!decoder->in_cmd_window) {
+        decoder->in_cmd_window   = true;
+        decoder->window_deadline = now + LED_CMD_TIMEOUT;
+    }
+
+    // Set num lock and caps lock bits when each is toggled on and off within
+    // the window.
+    if (num_lock_changed && ++decoder->num_lock_count == 2) {
+        decoder->led_cmd |= NUM_LOCK_BITMASK;
+        decoder->num_lock_count = 0;
+    }
+    if (caps_lock_changed && ++decoder->caps_lock_count == 2) {
+        decoder->led_cmd |= CAPS_LOCK_BITMASK;
+        decoder->caps_lock_count = 0;
+    }
+    return LED_CMD_EVENT_NONE;
+}
+
+led_cmd_event_t led_cmd_tick(led_cmd_decoder_t *decoder, uint32_t now) {
+    if (decoder->in_cmd_window && deadline_passed(decoder->window_deadline, now)) {
+        decoder->window_cmd = decoder->led_cmd;
+        reset_window(decoder);
+        return LED_CMD_EVENT_WINDOW;
+    }
+    if (decoder->in_cmd_frame && deadline_passed(decoder->frame_deadline, now)) {
+        reset_frame(decoder);
+        return LED_CMD_EVENT_FRAME_TIMEOUT;
+    }
+    return LED_CMD_EVENT_NONE;
+}
+
+uint32_t led_cmd_remaining(const led_cmd_decoder_t *decoder, uint32_t now) {
+    uint32_t deadline;
+    if (decoder->in_cmd_window) {
+        deadline = decoder->window_deadline;
+    } else if (decoder->in_cmd_frame) {
+        deadline = decoder->frame_deadline;
+    } else {
+        return 0;
+    }
+    return deadline_passed(deadline, now) ? 1 : deadline - now;
+}
@@ -0,0 +1,136 @@
+/* Copyright 2022 Aidan Gauland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Decoder for the commands sent over the lock LEDs. It only depends on the C
+// standard library and is driven with explicit timestamps, so it builds on the
+// host as well.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Bits of the host LED state (as in the HID LED report and led_t.raw).
+#define LED_CMD_NUM_LOCK 0x01
+#define LED_CMD_CAPS_LOCK 0x02
+#define LED_CMD_SCROLL_LOCK 0x04
+
+#define NUM_LOCK_BITMASK 0b01
+#define CAPS_LOCK_BITMASK 0b10
+
+// World record for fastest index finger tapping is 1092 taps per minute, which
+// is 55ms for a single tap.
+// https://recordsetter.com/world-record/index-finger-taps-minute/46066
+#define LED_CMD_TIMEOUT 25
+// Framed commands are dispatched as soon as their closing marker arrives, so
+// this only bounds the gap between two edges of a frame to recover from a lost
+// marker. Caps Lock is tapped with a 100ms hold and a 60ms wait, so it has to
+// cover that.
+#define LED_FRAME_TIMEOUT 250
+// When several trackballs are connected to one keyboard, give each of them its
+// own address, e.g. LED_CMD_ADDRESS 0b1 with LED_CMD_ADDRESS_LENGTH 1. They
+// then only accept frames of their address bits and an 8-bit payload (see
+// led_cmd.c), and ignore the 2-bit command windows.
+#ifndef LED_CMD_ADDRESS_LENGTH
+#    define LED_CMD_ADDRESS_LENGTH 0
+#    define LED_CMD_ADDRESS 0
+#endif
+#define LED_FRAME_MAX_LENGTH (8 + LED_CMD_ADDRESS_LENGTH)
+_Static_assert(LED_FRAME_MAX_LENGTH < 16, "LED_CMD_ADDRESS_LENGTH is too long");
+
+typedef enum {
+    // You could theoretically define 0b00 and send it by having a macro send
+    // the second tap after LED_CMD_TIMEOUT has elapsed.
+    // CMD_EXTRA = 0b00,
+    TG_SCROLL = 0b01,
+    CYC_DPI   = 0b10,
+    CMD_RESET = 0b11 // CMD_ prefix to avoid clash with QMK macro
+} led_cmd_t;
+
+// A frame is opened and closed by a Scroll Lock edge that we did not cause
+// ourselves. Inside a frame every Num Lock pair shifts a 0 and every Caps Lock
+// pair shifts a 1 into the command, so commands are identified by their length
+// and value.
+#define FRAME_CMD(length, value) (((uint16_t)(length) << 8) | (value))
+
+// The absolute mode commands are runs of Num Lock pairs only, since Caps Lock
+// has to be tapped a lot slower.
+typedef enum {
+    FRAME_SET_MOVE    = FRAME_CMD(0, 0),
+    FRAME_TG_SCROLL   = FRAME_CMD(1, 0b0),
+    FRAME_CYC_DPI     = FRAME_CMD(1, 0b1),
+    FRAME_SET_SCROLL  = FRAME_CMD(2, 0b00),
+    FRAME_SET_SNIPE   = FRAME_CMD(3, 0b000),
+    FRAME_SET_DPI     = FRAME_CMD(3, 0b100), // Low two bits are the DPI index
+    FRAME_SET_DPI_MAX = FRAME_CMD(3, 0b111),
+} frame_cmd_t;
+
+// Extended commands are a 1 followed by a 3-bit opcode and a 4-bit operand.
+#define FRAME_EXT_LENGTH 8
+#define FRAME_EXT_FLAG 0x80
+
+typedef enum {
+    EXT_SET_CPI              = 0b000, // CPI of (operand + 1) * 125
+    EXT_SET_SCROLL_DIVISOR_V = 0b001,
+    EXT_SET_SCROLL_DIVISOR_H = 0b010,
+    EXT_SET_ACCEL            = 0b011, // Acceleration profile, see accel_profile_t
+    EXT_SET_MOMENTUM         = 0b100, // Scroll momentum, 0 disables it
+} ext_opcode_t;
+
+typedef enum {
+    LED_CMD_EVENT_NONE,
+    LED_CMD_EVENT_WINDOW,        // A 2-bit command window expired, see window_cmd
+    LED_CMD_EVENT_FRAME,         // A frame for us was closed, see closed_frame
+    LED_CMD_EVENT_FRAME_TIMEOUT, // An open frame was dropped
+} led_cmd_event_t;
+
+typedef struct {
+    uint16_t value;
+    uint8_t  length;
+    uint8_t  num_lock_count;
+    uint8_t  caps_lock_count;
+} cmd_frame_state_t;
+
+typedef struct {
+    // Our copy of the host LED state.
+    uint8_t leds;
+
+    bool      in_cmd_window;
+    uint32_t  window_deadline;
+    led_cmd_t led_cmd;
+    uint8_t   num_lock_count;
+    uint8_t   caps_lock_count;
+
+    bool              in_cmd_frame;
+    uint32_t          frame_deadline;
+    cmd_frame_state_t frame;
+
+    // Results of the last event, valid until the next call.
+    led_cmd_t         window_cmd;
+    cmd_frame_state_t closed_frame;
+} led_cmd_decoder_t;
+
+void led_cmd_init(led_cmd_decoder_t *decoder, uint8_t leds);
+
+// Feeds a new host LED state. scroll_lock_owned is the Scroll Lock state we
+// last drove the host to, edges away from it open a frame.
+led_cmd_event_t led_cmd_update(led_cmd_decoder_t *decoder, uint8_t leds, bool scroll_lock_owned, uint32_t now);
+
+// Expires the command window or an unfinished frame.
+led_cmd_event_t led_cmd_tick(led_cmd_decoder_t *decoder, uint32_t now);
+
+// Time until led_cmd_tick() has to run next, 0 if nothing is pending.
+uint32_t led_cmd_remaining(const led_cmd_decoder_t *decoder, uint32_t now);
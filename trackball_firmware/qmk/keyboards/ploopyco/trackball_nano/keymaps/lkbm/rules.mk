@@ -1 +1,2 @@
 DEFERRED_EXEC_ENABLE = yes
+SRC += led_cmd.c
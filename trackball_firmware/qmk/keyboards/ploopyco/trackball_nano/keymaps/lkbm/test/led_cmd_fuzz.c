@@ -0,0 +1,201 @@
+/* Copyright 2022 Aidan Gauland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// libFuzzer target for the LED command decoder. The input is a start time (4
+// bytes) followed by (leds, owned, dt) triples: the next host LED state, our
+// Scroll Lock state (bit 0, and bit 1 to run a spurious tick as well) and the
+// ms since the previous report. Ticks run at the deadlines the decoder asks
+// for, like in the firmware. The edges are counted on the side to check every
+// event the decoder reports. See the readme for how to build it, with
+// LED_CMD_FUZZ_MAIN it runs random inputs without libFuzzer.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "led_cmd.h"
+
+#define FUZZ_CHECK(cond)                                                       \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+            abort();                                                           \
+        }                                                                      \
+    } while (0)
+
+// Lock edges the decoder should have seen since the window or frame opened.
+typedef struct {
+    uint32_t opened;
+    uint32_t last_edge;
+    uint8_t  num_lock_edges;
+    uint8_t  caps_lock_edges;
+} edge_count_t;
+
+static void count_edges(edge_count_t *count, uint8_t changed, uint32_t now) {
+    if (changed & LED_CMD_NUM_LOCK) {
+        count->num_lock_edges++;
+    }
+    if (changed & LED_CMD_CAPS_LOCK) {
+        count->caps_lock_edges++;
+    }
+    if (changed) {
+        count->last_edge = now;
+    }
+}
+
+static void check_event(const led_cmd_decoder_t *decoder, led_cmd_event_t event, const edge_count_t *window, const edge_count_t *frame, uint32_t now) {
+    switch (event) {
+        case LED_CMD_EVENT_WINDOW:
+            // Addressed trackballs have no windows.
+            FUZZ_CHECK(LED_CMD_ADDRESS_LENGTH == 0);
+            // A bit is only set for a lock key that went on and off within the
+            // window, and then always.
+            FUZZ_CHECK((int32_t)(now - window->opened) >= LED_CMD_TIMEOUT);
+            FUZZ_CHECK(!!(decoder->window_cmd & NUM_LOCK_BITMASK) == (window->num_lock_edges >= 2));
+            FUZZ_CHECK(!!(decoder->window_cmd & CAPS_LOCK_BITMASK) == (window->caps_lock_edges >= 2));
+            break;
+        case LED_CMD_EVENT_FRAME: {
+            const cmd_frame_state_t *closed = &decoder->closed_frame;
+            FUZZ_CHECK(closed->length <= LED_FRAME_MAX_LENGTH + 1);
+            FUZZ_CHECK(closed->value < (1u << closed->length));
+            // Every pair shifted one bit, up to one past the longest command.
+            int pairs = frame->num_lock_edges / 2 + frame->caps_lock_edges / 2;
+#if LED_CMD_ADDRESS_LENGTH > 0
+            // Addressed frames all have the same length.
+            FUZZ_CHECK(pairs == LED_FRAME_MAX_LENGTH);
+            FUZZ_CHECK(closed->length <= FRAME_EXT_LENGTH);
+#else
+            if (pairs <= LED_FRAME_MAX_LENGTH) {
+                FUZZ_CHECK(closed->length == pairs);
+                FUZZ_CHECK(__builtin_popcount(closed->value) == frame->caps_lock_edges / 2);
+            } else {
+                FUZZ_CHECK(closed->length == LED_FRAME_MAX_LENGTH + 1);
+            }
+#endif
+            break;
+        }
+        case LED_CMD_EVENT_FRAME_TIMEOUT:
+            FUZZ_CHECK((int32_t)(now - frame->last_edge) >= LED_FRAME_TIMEOUT);
+            break;
+        case LED_CMD_EVENT_NONE:
+            break;
+    }
+}
+
+static void check_state(const led_cmd_decoder_t *decoder, uint32_t now) {
+    FUZZ_CHECK(!(decoder->in_cmd_window && decoder->in_cmd_frame));
+    uint32_t remaining = led_cmd_remaining(decoder, now);
+    FUZZ_CHECK(remaining <= (decoder->in_cmd_window ? LED_CMD_TIMEOUT : LED_FRAME_TIMEOUT));
+    FUZZ_CHECK((remaining == 0) == !(decoder->in_cmd_window || decoder->in_cmd_frame));
+}
+
+static led_cmd_event_t tick(led_cmd_decoder_t *decoder, const edge_count_t *window, const edge_count_t *frame, uint32_t now) {
+    led_cmd_event_t event = led_cmd_tick(decoder, now);
+    check_event(decoder, event, window, frame, now);
+    check_state(decoder, now);
+    return event;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size < 4) {
+        return 0;
+    }
+    uint32_t now = data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+    data += 4;
+    size -= 4;
+
+    led_cmd_decoder_t decoder;
+    edge_count_t      window = {0};
+    edge_count_t      frame  = {0};
+    bool              owned  = false;
+    led_cmd_init(&decoder, 0);
+
+    for (; size >= 3; data += 3, size -= 3) {
+        uint8_t  leds          = data[0] & (LED_CMD_NUM_LOCK | LED_CMD_CAPS_LOCK | LED_CMD_SCROLL_LOCK);
+        bool     spurious_tick = data[1] & 0x02;
+        uint32_t dt            = data[2];
+
+        // The deferred callback runs when the decoder asked for it, and keeps
+        // running as long as something is pending.
+        for (uint32_t remaining; (remaining = led_cmd_remaining(&decoder, now)) != 0 && remaining <= dt;) {
+            now += remaining;
+            dt -= remaining;
+            tick(&decoder, &window, &frame, now);
+        }
+        now += dt;
+        if (spurious_tick) {
+            tick(&decoder, &window, &frame, now);
+        }
+
+        bool    was_in_window = decoder.in_cmd_window;
+        bool    was_in_frame  = decoder.in_cmd_frame;
+        uint8_t changed       = leds ^ decoder.leds;
+        owned                 = data[1] & 0x01;
+
+        led_cmd_event_t event = led_cmd_update(&decoder, leds, owned, now);
+        FUZZ_CHECK(decoder.leds == leds);
+
+        // Addressed trackballs take a Scroll Lock edge that closes no valid
+        // frame as the opening marker of the next one, and drop the report.
+        bool reopened = was_in_frame && decoder.in_cmd_frame && (changed & LED_CMD_SCROLL_LOCK);
+        FUZZ_CHECK(!reopened || LED_CMD_ADDRESS_LENGTH > 0);
+        FUZZ_CHECK(!decoder.in_cmd_window || LED_CMD_ADDRESS_LENGTH == 0);
+        if (reopened) {
+            frame = (edge_count_t){.opened = now, .last_edge = now};
+        } else {
+            if (!was_in_frame && (decoder.in_cmd_frame || event == LED_CMD_EVENT_FRAME)) {
+                FUZZ_CHECK(changed & LED_CMD_SCROLL_LOCK);
+                frame = (edge_count_t){.opened = now};
+            }
+            if (decoder.in_cmd_frame || was_in_frame) {
+                count_edges(&frame, changed, now);
+            }
+        }
+        if (!was_in_window && decoder.in_cmd_window) {
+            window = (edge_count_t){.opened = now};
+        }
+        if (decoder.in_cmd_window) {
+            count_edges(&window, changed, now);
+        }
+
+        check_event(&decoder, event, &window, &frame, now);
+        check_state(&decoder, now);
+    }
+    return 0;
+}
+
+#ifdef LED_CMD_FUZZ_MAIN
+// Runs the given inputs, or that many random ones, for compilers without
+// libFuzzer.
+int main(int argc, char **argv) {
+    static uint8_t input[4 + 3 * 256];
+    int            runs = argc > 1 ? atoi(argv[1]) : 100000;
+
+    srand(1);
+    for (int run = 0; run < runs; run++) {
+        size_t size = 4 + 3 * (rand() % 256);
+        for (size_t i = 0; i < size; i++) {
+            input[i] = rand();
+        }
+        // Mostly short gaps, so that windows and frames actually complete.
+        for (size_t i = 6; i < size; i += 3) {
+            input[i] %= (rand() % 4 == 0) ? 256 : 30;
+        }
+        LLVMFuzzerTestOneInput(input, size);
+    }
+    printf("%d runs passed\n", runs);
+    return 0;
+}
+#endif
@@ -0,0 +1,478 @@
+/* Copyright 2022 Aidan Gauland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host tests of the LED command decoder, driven by a fake clock. See the
+// readme for how to build and run them.
+
+#include <stdio.h>
+#include "led_cmd.h"
+
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
+
+static const char *current_test;
+static int         failures;
+
+#define CHECK_EQ(actual, expected) check_eq(__LINE__, #actual, (actual), (expected))
+
+static void check_eq(int line, const char *what, long long actual, long long expected) {
+    if (actual != expected) {
+        fprintf(stderr, "%s:%d: %s: %s is %lld, expected %lld\n", __FILE__, line, current_test, what, actual, expected);
+        failures++;
+    }
+}
+
+// The fake clock, in ms, and the host state as the trackball sees it.
+static uint32_t          now;
+static uint8_t           leds;
+static bool              scroll_lock_owned;
+static led_cmd_decoder_t decoder;
+
+// Events of led_cmd_tick() seen while advancing the clock.
+static int             tick_events;
+static led_cmd_event_t last_tick_event;
+
+static void start(const char *name, uint8_t initial_leds, uint32_t start_time) {
+    current_test      = name;
+    now               = start_time;
+    leds              = initial_leds;
+    scroll_lock_owned = initial_leds & LED_CMD_SCROLL_LOCK;
+    tick_events       = 0;
+    last_tick_event   = LED_CMD_EVENT_NONE;
+    led_cmd_init(&decoder, leds);
+}
+
+// Advances the clock one ms at a time, running led_cmd_tick() whenever
+// led_cmd_remaining() says it is due, like the firmware's deferred callback.
+// After a frame timeout the firmware adopts the host's Scroll Lock state.
+static void advance(uint32_t ms) {
+    for (uint32_t i = 0; i < ms; i++) {
+        uint32_t remaining = led_cmd_remaining(&decoder, now);
+        now++;
+        if (remaining == 1) {
+            led_cmd_event_t event = led_cmd_tick(&decoder, now);
+            if (event != LED_CMD_EVENT_NONE) {
+                tick_events++;
+                last_tick_event = event;
+            }
+            if (event == LED_CMD_EVENT_FRAME_TIMEOUT) {
+                scroll_lock_owned = leds & LED_CMD_SCROLL_LOCK;
+            }
+        }
+    }
+}
+
+// After a frame the firmware adopts the host's Scroll Lock state as well.
+static led_cmd_event_t toggle(uint8_t mask) {
+    leds ^= mask;
+    led_cmd_event_t event = led_cmd_update(&decoder, leds, scroll_lock_owned, now);
+    if (event == LED_CMD_EVENT_FRAME) {
+        scroll_lock_owned = leds & LED_CMD_SCROLL_LOCK;
+    }
+    return event;
+}
+
+// Taps a lock key on and off the way the keyboard macros do.
+static void tap(uint8_t mask, uint32_t tap_ms, uint32_t wait_ms) {
+    CHECK_EQ(toggle(mask), LED_CMD_EVENT_NONE);
+    advance(tap_ms);
+    CHECK_EQ(toggle(mask), LED_CMD_EVENT_NONE);
+    advance(wait_ms);
+}
+
+// Sends length bits of value (most significant first) between two frame
+// markers, with Caps Lock taps as slow as caps_ms. Returns the event of the
+// closing marker.
+static led_cmd_event_t send_raw_frame(uint8_t length, uint16_t value, uint32_t caps_ms) {
+    CHECK_EQ(toggle(LED_CMD_SCROLL_LOCK), LED_CMD_EVENT_NONE);
+    advance(5);
+    for (int bit = length - 1; bit >= 0; bit--) {
+        if (value & (1 << bit)) {
+            tap(LED_CMD_CAPS_LOCK, caps_ms, caps_ms);
+        } else {
+            tap(LED_CMD_NUM_LOCK, 5, 5);
+        }
+    }
+    return toggle(LED_CMD_SCROLL_LOCK);
+}
+
+// Same, with our address in front and the command in the 8-bit payload of
+// addressed frames.
+static led_cmd_event_t send_frame(uint8_t length, uint16_t value, uint32_t caps_ms) {
+#if LED_CMD_ADDRESS_LENGTH > 0
+    if (length != FRAME_EXT_LENGTH) {
+        value |= 1 << length;
+    }
+    length = FRAME_EXT_LENGTH;
+#endif
+    return send_raw_frame(length + LED_CMD_ADDRESS_LENGTH, ((uint16_t)LED_CMD_ADDRESS << length) | value, caps_ms);
+}
+
+static void check_frame(uint8_t length, uint16_t value) {
+    CHECK_EQ(decoder.closed_frame.length, length);
+    CHECK_EQ(decoder.closed_frame.value, value);
+    CHECK_EQ(decoder.in_cmd_frame, false);
+    CHECK_EQ(tick_events, 0);
+}
+
+#if LED_CMD_ADDRESS_LENGTH == 0
+static void test_window_commands(void) {
+    static const struct {
+        const char *name;
+        uint8_t     masks[4];
+        led_cmd_t   cmd;
+    } windows[] = {
+        {"window TG_SCROLL", {LED_CMD_NUM_LOCK, LED_CMD_NUM_LOCK}, TG_SCROLL},
+        {"window CYC_DPI", {LED_CMD_CAPS_LOCK, LED_CMD_CAPS_LOCK}, CYC_DPI},
+        {"window CMD_RESET", {LED_CMD_NUM_LOCK, LED_CMD_NUM_LOCK, LED_CMD_CAPS_LOCK, LED_CMD_CAPS_LOCK}, CMD_RESET},
+        {"window CMD_RESET interleaved", {LED_CMD_NUM_LOCK, LED_CMD_CAPS_LOCK, LED_CMD_NUM_LOCK, LED_CMD_CAPS_LOCK}, CMD_RESET},
+        {"window CMD_RESET merged", {LED_CMD_NUM_LOCK | LED_CMD_CAPS_LOCK, LED_CMD_NUM_LOCK | LED_CMD_CAPS_LOCK}, CMD_RESET},
+    };
+
+    for (size_t i = 0; i < ARRAY_SIZE(windows); i++) {
+        start(windows[i].name, 0, 1000);
+        uint32_t opened = now;
+        for (int j = 0; j < 4 && windows[i].masks[j]; j++) {
+            CHECK_EQ(toggle(windows[i].masks[j]), LED_CMD_EVENT_NONE);
+            advance(2);
+        }
+        // The window runs from its first edge, however many followed.
+        advance(opened + LED_CMD_TIMEOUT - 1 - now);
+        CHECK_EQ(tick_events, 0);
+        advance(1);
+        CHECK_EQ(tick_events, 1);
+        CHECK_EQ(last_tick_event, LED_CMD_EVENT_WINDOW);
+        CHECK_EQ(decoder.window_cmd, windows[i].cmd);
+        CHECK_EQ(led_cmd_remaining(&decoder, now), 0);
+    }
+}
+
+// A lock key only counts once it was turned on and off again within the same
+// window, a single edge of it must not add its bit.
+static void test_window_needs_pairs(void) {
+    start("window with one NLCK edge", 0, 0);
+    toggle(LED_CMD_NUM_LOCK);
+    tap(LED_CMD_CAPS_LOCK, 2, 2);
+    advance(LED_CMD_TIMEOUT);
+    CHECK_EQ(last_tick_event, LED_CMD_EVENT_WINDOW);
+    CHECK_EQ(decoder.window_cmd, CYC_DPI);
+
+    start("window with one CLCK edge", 0, 0);
+    tap(LED_CMD_NUM_LOCK, 2, 2);
+    toggle(LED_CMD_CAPS_LOCK);
+    advance(LED_CMD_TIMEOUT);
+    CHECK_EQ(last_tick_event, LED_CMD_EVENT_WINDOW);
+    CHECK_EQ(decoder.window_cmd, TG_SCROLL);
+
+    start("window with single edges", 0, 0);
+    toggle(LED_CMD_NUM_LOCK | LED_CMD_CAPS_LOCK);
+    advance(LED_CMD_TIMEOUT);
+    CHECK_EQ(last_tick_event, LED_CMD_EVENT_WINDOW);
+    CHECK_EQ(decoder.window_cmd, 0);
+
+    // A pair split across two windows is two single edges.
+    start("window pair split by the timeout", 0, 0);
+    toggle(LED_CMD_NUM_LOCK);
+    tap(LED_CMD_CAPS_LOCK, 2, 2);
+    advance(LED_CMD_TIMEOUT);
+    toggle(LED_CMD_NUM_LOCK);
+    toggle(LED_CMD_CAPS_LOCK);
+    advance(LED_CMD_TIMEOUT);
+    CHECK_EQ(tick_events, 2);
+    CHECK_EQ(decoder.window_cmd, 0);
+}
+#else
+// Windows carry no address, so they must not reach any of the trackballs.
+static void test_windows_ignored(void) {
+    start("window ignored", 0, 0);
+    tap(LED_CMD_NUM_LOCK, 2, 2);
+    tap(LED_CMD_CAPS_LOCK, 2, 2);
+    CHECK_EQ(decoder.in_cmd_window, false);
+    advance(LED_CMD_TIMEOUT);
+    CHECK_EQ(tick_events, 0);
+}
+#endif
+
+static void test_frame_commands(void) {
+    static const struct {
+        const char *name;
+        uint8_t     length;
+        uint16_t    value;
+        uint16_t    cmd;
+    } frames[] = {
+        {"frame SET_MOVE", 0, 0, FRAME_SET_MOVE},
+        {"frame TG_SCROLL", 1, 0b0, FRAME_TG_SCROLL},
+        {"frame CYC_DPI", 1, 0b1, FRAME_CYC_DPI},
+        {"frame SET_SCROLL", 2, 0b00, FRAME_SET_SCROLL},
+        {"frame SET_SNIPE", 3, 0b000, FRAME_SET_SNIPE},
+        {"frame SET_DPI 0", 3, 0b100, FRAME_SET_DPI},
+        {"frame SET_DPI 1", 3, 0b101, FRAME_SET_DPI + 1},
+        {"frame SET_DPI 2", 3, 0b110, FRAME_SET_DPI + 2},
+        {"frame SET_DPI_MAX", 3, 0b111, FRAME_SET_DPI_MAX},
+    };
+
+    for (size_t i = 0; i < ARRAY_SIZE(frames); i++) {
+        // Fast Caps Lock taps, and the slow ones of hosts that delay them.
+        for (uint32_t caps_ms = 5; caps_ms <= 100; caps_ms += 95) {
+            start(frames[i].name, 0, 0);
+            CHECK_EQ(send_frame(frames[i].length, frames[i].value, caps_ms), LED_CMD_EVENT_FRAME);
+            check_frame(frames[i].length, frames[i].value);
+            CHECK_EQ(FRAME_CMD(decoder.closed_frame.length, decoder.closed_frame.value), frames[i].cmd);
+        }
+    }
+
+    for (ext_opcode_t opcode = EXT_SET_CPI; opcode <= EXT_SET_MOMENTUM; opcode++) {
+        for (uint8_t operand = 0; operand < 16; operand++) {
+            start("frame extended", 0, 0);
+            uint16_t value = FRAME_EXT_FLAG | (opcode << 4) | operand;
+            CHECK_EQ(send_frame(FRAME_EXT_LENGTH, value, 5), LED_CMD_EVENT_FRAME);
+            check_frame(FRAME_EXT_LENGTH, value);
+        }
+    }
+}
+
+static void test_frame_timeout(void) {
+    start("frame timeout", 0, 0);
+    toggle(LED_CMD_SCROLL_LOCK);
+    CHECK_EQ(decoder.in_cmd_frame, true);
+    CHECK_EQ(led_cmd_remaining(&decoder, now), LED_FRAME_TIMEOUT);
+    advance(LED_FRAME_TIMEOUT - 1);
+    CHECK_EQ(tick_events, 0);
+    advance(1);
+    CHECK_EQ(tick_events, 1);
+    CHECK_EQ(last_tick_event, LED_CMD_EVENT_FRAME_TIMEOUT);
+    CHECK_EQ(decoder.in_cmd_frame, false);
+
+    // The lost closing marker must not leave pairs behind: they are a window
+    // again, and the next marker opens a new frame from the adopted state.
+    tap(LED_CMD_NUM_LOCK, 2, 2);
+    advance(LED_CMD_TIMEOUT);
+#if LED_CMD_ADDRESS_LENGTH == 0
+    CHECK_EQ(last_tick_event, LED_CMD_EVENT_WINDOW);
+    CHECK_EQ(decoder.window_cmd, TG_SCROLL);
+#endif
+    CHECK_EQ(send_frame(2, 0b00, 5), LED_CMD_EVENT_FRAME);
+    CHECK_EQ(decoder.closed_frame.length, 2);
+
+    // Every edge of the frame pushes the deadline out.
+    start("frame timeout extended by edges", 0, 0);
+    toggle(LED_CMD_SCROLL_LOCK);
+    advance(200);
+    toggle(LED_CMD_CAPS_LOCK);
+    advance(200);
+    toggle(LED_CMD_CAPS_LOCK);
+    advance(LED_FRAME_TIMEOUT - 1);
+    CHECK_EQ(tick_events, 0);
+    advance(1);
+    CHECK_EQ(last_tick_event, LED_CMD_EVENT_FRAME_TIMEOUT);
+}
+
+// Scroll Lock edges towards the state we drove the host to are the echo of
+// our own motion signal, not frame markers.
+static void test_owned_scroll_lock(void) {
+    start("owned scroll lock", 0, 0);
+    scroll_lock_owned = true;
+    CHECK_EQ(toggle(LED_CMD_SCROLL_LOCK), LED_CMD_EVENT_NONE);
+    CHECK_EQ(decoder.in_cmd_frame, false);
+
+    // While we are moving, a frame starts by turning Scroll Lock off.
+    CHECK_EQ(send_frame(2, 0b00, 5), LED_CMD_EVENT_FRAME);
+    check_frame(2, 0b00);
+
+    scroll_lock_owned = false;
+    CHECK_EQ(toggle(LED_CMD_SCROLL_LOCK), LED_CMD_EVENT_NONE);
+    CHECK_EQ(decoder.in_cmd_frame, false);
+    advance(LED_FRAME_TIMEOUT);
+    CHECK_EQ(tick_events, 0);
+}
+
+static void test_interleavings(void) {
+    // A frame takes over from a window in progress, which is dropped.
+    start("frame during a window", 0, 0);
+    toggle(LED_CMD_NUM_LOCK);
+    CHECK_EQ(decoder.in_cmd_window, LED_CMD_ADDRESS_LENGTH == 0);
+    CHECK_EQ(send_frame(3, 0b000, 5), LED_CMD_EVENT_FRAME);
+    check_frame(3, 0b000);
+    advance(LED_FRAME_TIMEOUT);
+    CHECK_EQ(tick_events, 0);
+
+#if LED_CMD_ADDRESS_LENGTH == 0
+    // Hosts may merge the markers with the payload into one report.
+    start("frame merged with its markers", 0, 0);
+    CHECK_EQ(toggle(LED_CMD_SCROLL_LOCK | LED_CMD_NUM_LOCK), LED_CMD_EVENT_NONE);
+    CHECK_EQ(toggle(LED_CMD_NUM_LOCK | LED_CMD_CAPS_LOCK), LED_CMD_EVENT_NONE);
+    CHECK_EQ(toggle(LED_CMD_SCROLL_LOCK | LED_CMD_CAPS_LOCK), LED_CMD_EVENT_FRAME);
+    check_frame(2, 0b01);
+#endif
+
+    // Frames back to back, and a window right after them.
+    start("frames back to back", 0, 0);
+    CHECK_EQ(send_frame(2, 0b00, 5), LED_CMD_EVENT_FRAME);
+    check_frame(2, 0b00);
+    CHECK_EQ(send_frame(0, 0, 5), LED_CMD_EVENT_FRAME);
+    check_frame(0, 0);
+#if LED_CMD_ADDRESS_LENGTH == 0
+    tap(LED_CMD_CAPS_LOCK, 2, 2);
+    advance(LED_CMD_TIMEOUT);
+    CHECK_EQ(last_tick_event, LED_CMD_EVENT_WINDOW);
+    CHECK_EQ(decoder.window_cmd, CYC_DPI);
+#endif
+
+    // Our motion signal in between two frames.
+    start("motion between frames", 0, 0);
+    CHECK_EQ(send_frame(1, 0b1, 5), LED_CMD_EVENT_FRAME);
+    scroll_lock_owned = true;
+    CHECK_EQ(toggle(LED_CMD_SCROLL_LOCK), LED_CMD_EVENT_NONE);
+    CHECK_EQ(send_frame(1, 0b0, 5), LED_CMD_EVENT_FRAME);
+    check_frame(1, 0b0);
+}
+
+static void test_overlong_frame(void) {
+    start("overlong frame", 0, 0);
+    led_cmd_event_t event = send_raw_frame(LED_FRAME_MAX_LENGTH + 3, 0, 5);
+    if (event == LED_CMD_EVENT_FRAME) {
+        CHECK_EQ(decoder.closed_frame.length > FRAME_EXT_LENGTH, true);
+    }
+    // Addressed trackballs take the closing marker as the start of a frame.
+    CHECK_EQ(decoder.in_cmd_frame, LED_CMD_ADDRESS_LENGTH > 0);
+}
+
+#if LED_CMD_ADDRESS_LENGTH > 0
+static void test_foreign_address(void) {
+    start("frame for another address", 0, 0);
+    uint16_t other = LED_CMD_ADDRESS ^ 1;
+    CHECK_EQ(send_raw_frame(LED_FRAME_MAX_LENGTH, (other << FRAME_EXT_LENGTH) | 0b100, 5), LED_CMD_EVENT_NONE);
+    CHECK_EQ(decoder.in_cmd_frame, false);
+
+    start("frame without a command", 0, 0);
+    CHECK_EQ(send_raw_frame(LED_FRAME_MAX_LENGTH, (uint16_t)LED_CMD_ADDRESS << FRAME_EXT_LENGTH, 5), LED_CMD_EVENT_NONE);
+    CHECK_EQ(decoder.in_cmd_frame, false);
+}
+
+// The frames of the stock bindings carry no address. Our address followed by
+// the stock command is no frame either, since it is too short.
+static void test_unaddressed_frames(void) {
+    static const struct {
+        uint8_t  length;
+        uint16_t value;
+    } frames[] = {{0, 0}, {1, 0b0}, {1, 0b1}, {2, 0b00}, {3, 0b000}, {3, 0b110}, {FRAME_EXT_LENGTH, FRAME_EXT_FLAG | 0x13}};
+
+    for (size_t i = 0; i < ARRAY_SIZE(frames); i++) {
+        start("unaddressed frame", 0, 0);
+        CHECK_EQ(send_raw_frame(frames[i].length, frames[i].value, 5), LED_CMD_EVENT_NONE);
+        advance(LED_FRAME_TIMEOUT);
+        CHECK_EQ(decoder.in_cmd_frame, false);
+
+        start("stock frame behind our address", 0, 0);
+        if (frames[i].length < FRAME_EXT_LENGTH) {
+            uint16_t value = ((uint16_t)LED_CMD_ADDRESS << frames[i].length) | frames[i].value;
+            CHECK_EQ(send_raw_frame(LED_CMD_ADDRESS_LENGTH + frames[i].length, value, 5), LED_CMD_EVENT_NONE);
+        }
+
+        // A frame right behind the closing marker of the dropped one still
+        // lands.
+        CHECK_EQ(send_frame(2, 0b00, 5), LED_CMD_EVENT_FRAME);
+        CHECK_EQ(FRAME_CMD(decoder.closed_frame.length, decoder.closed_frame.value), FRAME_SET_SCROLL);
+    }
+}
+
+// Another trackball drives the shared Scroll Lock LED as well, and its edges
+// open frames here. The next marker has to take over from them.
+static void test_foreign_scroll_lock(void) {
+    for (uint32_t gap = 1; gap < LED_FRAME_TIMEOUT; gap += 5) {
+        start("frame after a foreign Scroll Lock edge", 0, 0);
+        toggle(LED_CMD_SCROLL_LOCK);
+        advance(gap);
+        CHECK_EQ(send_frame(2, 0b00, 5), LED_CMD_EVENT_FRAME);
+        check_frame(2, 0b00);
+
+        start("frame after a foreign acknowledgement", 0, 0);
+        toggle(LED_CMD_SCROLL_LOCK);
+        advance(gap);
+        toggle(LED_CMD_SCROLL_LOCK);
+        advance(5);
+        CHECK_EQ(send_frame(FRAME_EXT_LENGTH, FRAME_EXT_FLAG | 0x25, 5), LED_CMD_EVENT_FRAME);
+        check_frame(FRAME_EXT_LENGTH, FRAME_EXT_FLAG | 0x25);
+    }
+
+    // An edge in the middle of a frame loses it, but is never mistaken for a
+    // command, and the next frame lands again. Right behind the opening marker
+    // it only reopens the frame.
+    for (int edge_after = 0; edge_after < LED_FRAME_MAX_LENGTH; edge_after++) {
+        start("foreign Scroll Lock edge inside a frame", 0, 0);
+        uint16_t frame = ((uint16_t)LED_CMD_ADDRESS << FRAME_EXT_LENGTH) | 0b1111;
+        CHECK_EQ(toggle(LED_CMD_SCROLL_LOCK), LED_CMD_EVENT_NONE);
+        advance(5);
+        for (int bit = LED_FRAME_MAX_LENGTH - 1; bit >= 0; bit--) {
+            if (LED_FRAME_MAX_LENGTH - 1 - bit == edge_after) {
+                CHECK_EQ(toggle(LED_CMD_SCROLL_LOCK), LED_CMD_EVENT_NONE);
+                advance(3);
+            }
+            tap((frame & (1 << bit)) ? LED_CMD_CAPS_LOCK : LED_CMD_NUM_LOCK, 5, 5);
+        }
+        CHECK_EQ(toggle(LED_CMD_SCROLL_LOCK), edge_after == 0 ? LED_CMD_EVENT_FRAME : LED_CMD_EVENT_NONE);
+        CHECK_EQ(send_frame(1, 0b1, 5), LED_CMD_EVENT_FRAME);
+        check_frame(1, 0b1);
+    }
+}
+#endif
+
+// Timestamps wrap around after 49 days.
+static void test_clock_wraparound(void) {
+#if LED_CMD_ADDRESS_LENGTH == 0
+    start("window across the wraparound", 0, UINT32_MAX - 5);
+    tap(LED_CMD_NUM_LOCK, 2, 2);
+    CHECK_EQ(led_cmd_remaining(&decoder, now), LED_CMD_TIMEOUT - 4);
+    advance(LED_CMD_TIMEOUT);
+    CHECK_EQ(tick_events, 1);
+    CHECK_EQ(decoder.window_cmd, TG_SCROLL);
+#endif
+
+    start("frame across the wraparound", 0, UINT32_MAX - 20);
+    CHECK_EQ(send_frame(3, 0b101, 5), LED_CMD_EVENT_FRAME);
+    check_frame(3, 0b101);
+
+    start("frame timeout across the wraparound", 0, UINT32_MAX - 100);
+    toggle(LED_CMD_SCROLL_LOCK);
+    advance(LED_FRAME_TIMEOUT);
+    CHECK_EQ(last_tick_event, LED_CMD_EVENT_FRAME_TIMEOUT);
+}
+
+int main(void) {
+#if LED_CMD_ADDRESS_LENGTH == 0
+    test_window_commands();
+    test_window_needs_pairs();
+#else
+    test_windows_ignored();
+#endif
+    test_frame_commands();
+    test_frame_timeout();
+    test_owned_scroll_lock();
+    test_interleavings();
+    test_overlong_frame();
+#if LED_CMD_ADDRESS_LENGTH > 0
+    test_foreign_address();
+    test_unaddressed_frames();
+    test_foreign_scroll_lock();
+#endif
+    test_clock_wraparound();
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
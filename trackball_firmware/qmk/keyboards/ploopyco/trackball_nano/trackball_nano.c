@@ -60,15 +60,70 @@ void cycle_dpi(void) {
 #endif
 }
 
-// TODO: Implement libinput profiles
-// https://wayland.freedesktop.org/libinput/doc/latest/pointer-acceleration.html
-// Compile time accel selection
-// Valid options are ACC_NONE, ACC_LINEAR, ACC_CUSTOM, ACC_QUADRATIC
+void set_dpi_index(uint8_t index) {
+  keyboard_config.dpi_config = index % DPI_OPTION_SIZE;
+  pointing_device_set_cpi(dpi_array[keyboard_config.dpi_config]);
+#ifdef CONSOLE_ENABLE
+  uprintf("DPI is now %d\n", dpi_array[keyboard_config.dpi_config]);
+#endif
+}
+
+// Pointer acceleration, selectable at compile time and at runtime with
+// set_accel_profile(). Valid options are ACC_NONE, ACC_LINEAR, ACC_QUADRATIC
+// and ACC_CUSTOM.
+#ifndef PLOOPY_ACCEL_PROFILE
+#    define PLOOPY_ACCEL_PROFILE ACC_NONE
+#endif
+
+// The curves map the speed (|x| + |y| counts per report, in steps of
+// ACCEL_SPEED_STEP) to a gain in 1/16ths, so no float math is needed.
+#define ACCEL_LUT_SIZE 16
+#define ACCEL_SPEED_STEP 2
+#define ACCEL_GAIN_SHIFT 4
+
+#ifndef PLOOPY_ACCEL_CUSTOM_CURVE
+// Slows down small corrections and speeds up fast flicks.
+#    define PLOOPY_ACCEL_CUSTOM_CURVE \
+        { 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30, 32, 32, 32, 32 }
+#endif
+
+static const uint8_t PROGMEM accel_curves[ACC_PROFILE_COUNT][ACCEL_LUT_SIZE] = {
+    [ACC_NONE]      = { 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16 },
+    [ACC_LINEAR]    = { 16, 18, 20, 22, 24, 26, 28, 30, 32, 34, 36, 38, 40, 42, 44, 46 },
+    [ACC_QUADRATIC] = { 16, 16, 17, 18, 20, 22, 25, 28, 32, 36, 41, 46, 52, 58, 65, 72 },
+    [ACC_CUSTOM]    = PLOOPY_ACCEL_CUSTOM_CURVE,
+};
+
+static accel_profile_t accel_profile = PLOOPY_ACCEL_PROFILE;
+// Fractions of a count that were left over, carried into the next report.
+static int8_t accel_remainder_x = 0;
+static int8_t accel_remainder_y = 0;
+
+void set_accel_profile(uint8_t profile) {
+  accel_profile     = profile < ACC_PROFILE_COUNT ? profile : ACC_NONE;
+  accel_remainder_x = 0;
+  accel_remainder_y = 0;
+#ifdef CONSOLE_ENABLE
+  uprintf("Acceleration profile is now %d\n", accel_profile);
+#endif
+}
+
+static mouse_xy_report_t accelerate(mouse_xy_report_t delta, uint8_t gain, int8_t *remainder) {
+    int16_t scaled = (int16_t)delta * gain + *remainder;
+    int16_t result = scaled / (1 << ACCEL_GAIN_SHIFT);
+
+    *remainder = scaled - result * (1 << ACCEL_GAIN_SHIFT);
+    if (result > XY_REPORT_MAX) {
+        return XY_REPORT_MAX;
+    }
+    if (result < XY_REPORT_MIN) {
+        return XY_REPORT_MIN;
+    }
+    return result;
+}
 
 // Trackball State
 bool     is_scroll_clicked = false;
-bool     BurstState        = false;  // init burst state for Trackball module
-uint16_t MotionStart       = 0;      // Timer for accel, 0 is resting state
 
 void pointing_device_init_kb(void) {
     // set the DPI.
@@ -113,3 +168,17 @@ void matrix_init_kb(void) {
     }
     matrix_init_user();
 }
+
+report_mouse_t pointing_device_task_kb(report_mouse_t mouse_report) {
+    mouse_report = pointing_device_task_user(mouse_report);
+    if (accel_profile == ACC_NONE || (mouse_report.x == 0 && mouse_report.y == 0)) {
+        return mouse_report;
+    }
+
+    uint16_t speed = (ABS(mouse_report.x) + ABS(mouse_report.y)) / ACCEL_SPEED_STEP;
+    uint8_t  gain  = pgm_read_byte(&accel_curves[accel_profile][MIN(speed, ACCEL_LUT_SIZE - 1)]);
+
+    mouse_report.x = accelerate(mouse_report.x, gain, &accel_remainder_x);
+    mouse_report.y = accelerate(mouse_report.y, gain, &accel_remainder_y);
+    return mouse_report;
+}
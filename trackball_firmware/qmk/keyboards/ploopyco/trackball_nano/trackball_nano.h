@@ -30,8 +30,18 @@ typedef union {
 
 extern keyboard_config_t keyboard_config;
 
+typedef enum {
+    ACC_NONE,
+    ACC_LINEAR,
+    ACC_QUADRATIC,
+    ACC_CUSTOM,
+    ACC_PROFILE_COUNT
+} accel_profile_t;
+
 enum ploopy_keycodes {
     DPI_CONFIG = QK_KB_0,
 };
 
 void cycle_dpi(void);
+void set_dpi_index(uint8_t index);
+void set_accel_profile(uint8_t profile);